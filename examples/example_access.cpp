@@ -12,7 +12,11 @@ int main() {
   sinks.push_back(sink1);
 
   using AccessLog = castis::logger::AccessLog;
-  auto sinkaccess = castis::logger::init_access_logger("access");
+  castis::logger::AccessStatsOptions stats_options;
+  stats_options.summary_path_ = "./log/access_stats.log";
+  auto stats = std::make_shared<castis::logger::access_stats>(stats_options);
+  auto sinkaccess = castis::logger::init_access_logger(
+      "access", "./log", 10 * 1024 * 1024, true, {}, stats);
   sinks.push_back(sinkaccess);
 
   auto request1_time = boost::posix_time::microsec_clock::universal_time();
@@ -30,6 +34,7 @@ int main() {
   ACCESSLOG(a);
 
   auto request2_time = boost::posix_time::microsec_clock::universal_time();
+  auto request2_start = std::chrono::steady_clock::now();
   std::this_thread::sleep_for(std::chrono::seconds(2));
 
   AccessLog b = AccessLog{
@@ -42,10 +47,12 @@ int main() {
       5016,
       "http://www.google.com/",
       "chrome/10.0",
-      castis::logger::accesslog::serve_duration(request2_time)};
+      castis::logger::accesslog::serve_duration(request2_start)};
 
   ACCESSLOG(b);
   CIMLOG(module1, debug) << "Just a foo";
+  // detaching writes the summary of the last requests
+  castis::logger::set_access_stats(nullptr);
 
   for (auto& sink : sinks) {
     castis::logger::stop_logger(sink);
@@ -0,0 +1,27 @@
+#define CASTIS_CILOG_BINARY
+#include <chrono>
+#include <cstdio>
+
+#include "logger/castislogger.h"
+
+// CILOG statements with a format string are written as binary entries to
+// ./log/<YYYY-MM>/<YYYY-MM-DD>_example.clog, expand them with
+//   cilog-decode log/example.clog
+int main() {
+  auto logger = castis::logger::init_binary_logger("example", "1.0.0");
+
+  constexpr int kLines = 1000000;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kLines; ++i) {
+    CILOG(info, "{}th log with some message, {:.2f}", i, i * 0.5);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  CILOG(warning, "strings({:s}), integers({:d})", "abc", 1);
+
+  castis::logger::stop_logger(logger);
+
+  std::printf("%.1f ns/call\n",
+              std::chrono::duration<double, std::nano>(elapsed).count() /
+                  kLines);
+  return 0;
+}
@@ -1,10 +1,9 @@
 #include "logger/castislogger.h"
 
-BOOST_LOG_ATTRIBUTE_KEYWORD(severity, "Severity", severity_level)
-
 int main() {
   auto sink = castis::logger::init_async_logger("example", "1.0.0");
-  boost::log::core::get()->set_filter(severity >= warning);
+  // rejected statements return before a record is opened
+  castis::logger::set_severity_threshold(warning);
 
   // support severity levels
   CILOG(foo) << "Just a foo";
@@ -0,0 +1,53 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "logger/castislogger.h"
+
+// Writes the same lines through init_async_logger and init_async_uring_logger
+// and prints the throughput of each. Point it at a slow or throttled disk to
+// see the difference, e.g. a directory on a cgroup with io.max set:
+//   ./example_uring /mnt/slow/log
+template <typename InitT>
+void run(const char* name, InitT init) {
+  constexpr int kLines = 1000000;
+  auto start = std::chrono::steady_clock::now();
+  auto sink = init();
+  for (int i = 0; i < kLines; ++i) {
+    CILOG(info) << i << "th log with some message";
+  }
+  auto logged = std::chrono::steady_clock::now();
+  castis::logger::stop_logger(sink);
+  sink.reset();
+  auto written = std::chrono::steady_clock::now();
+
+  auto ms = [](auto d) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+  };
+  std::printf("%-6s logged in %6lldms, written in %6lldms, %8.0f lines/s\n",
+              name, static_cast<long long>(ms(logged - start)),
+              static_cast<long long>(ms(written - start)),
+              kLines * 1000.0 / std::max<long long>(1, ms(written - start)));
+}
+
+int main(int argc, char* argv[]) {
+  std::string target = argc > 1 ? argv[1] : "./log";
+  // batched flushes that only write, sync_ would add an fdatasync on the
+  // io_uring backend
+  castis::logger::FlushPolicy flush_policy(std::chrono::milliseconds(100),
+                                           256 * 1024);
+
+  run("write", [&] {
+    return castis::logger::init_async_logger(
+        "example_write", "1.0.0", target, 100 * 1024 * 1024, flush_policy);
+  });
+  run("uring", [&] {
+    return castis::logger::init_async_uring_logger(
+        "example_uring", "1.0.0", target, 100 * 1024 * 1024, flush_policy);
+  });
+  castis::logger::detail::uring_file probe;
+  if (!probe.uses_ring()) std::printf("io_uring unavailable, used write(2)\n");
+
+  return 0;
+}
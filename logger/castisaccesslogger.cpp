@@ -16,10 +16,16 @@ std::string request_line(std::string_view method, std::string_view uri,
                      kDelimiter, version_major, version_minor);
 }
 
+std::uint64_t serve_duration(std::chrono::steady_clock::time_point req_start) {
+  auto duration = std::chrono::steady_clock::now() - req_start;
+  return std::chrono::duration_cast<std::chrono::microseconds>(duration)
+      .count();
+}
+
 std::uint64_t serve_duration(boost::posix_time::ptime req_utc) {
   auto res_utc = boost::posix_time::microsec_clock::universal_time();
   auto duration = res_utc - req_utc;
-  std::uint64_t du = duration.total_milliseconds();
+  std::uint64_t du = duration.total_microseconds();
   return du;
 }
 
@@ -58,6 +64,53 @@ AccessLog::AccessLog(std::string_view remote_addr,
 // [:data] foramt -> [05/Sep/2018:16:48:09 +0900]
 // ':remote-addr - - [:date] ":method :uri HTTP/:http-version" :status
 // :res[content-length] ":referrer" ":user-agent"'
+namespace detail {
+// the aggregator of set_access_stats, ACCESSLOG reads it with std::atomic_load
+std::shared_ptr<access_stats> current_access_stats;
+
+// The access sink does not take its records, the rollup sink still counts them
+FormatSite const& unsampled_site() {
+  static const CallSite site(cilogger_file_name(__FILE__), __FUNCTION__,
+                             __LINE__, "access", "access.unsampled");
+  static const FormatSite format_site(site, accesslog::kCombined);
+  return format_site;
+}
+
+void push_access_log(FormatSite const& site, AccessLog const& accesslog) {
+  namespace alog = castis::logger::accesslog;
+  auto* target = &site;
+  if (auto stats = std::atomic_load(&current_access_stats)) {
+    stats->record(accesslog);
+    // the statement count of this thread decides which lines are written
+    auto log_every = stats->options().log_every_;
+    thread_local std::size_t statements = 0;
+    if (log_every == 0 || statements++ % log_every != 0) {
+      target = &unsampled_site();
+    }
+  }
+  auto field = [](std::string const& value) {
+    return value.empty() ? alog::kEmpty : std::string_view(value);
+  };
+  auto& encoded = thread_encode_buffer();
+  encode_args(encoded, field(accesslog.remote_addr_),
+              field(accesslog.remote_ident_), field(accesslog.user_name_),
+              field(accesslog.request_time_), field(accesslog.request_line_));
+  if (accesslog.status_ > 0) {
+    encode_arg(encoded, accesslog.status_);
+  } else {
+    encode_arg(encoded, alog::kEmpty);
+  }
+  if (accesslog.content_length_ > 0) {
+    encode_arg(encoded, accesslog.content_length_);
+  } else {
+    encode_arg(encoded, alog::kEmpty);
+  }
+  encode_args(encoded, field(accesslog.referer_),
+              field(accesslog.user_agent_));
+  push_deferred(*target, info, encoded);
+}
+}  // namespace detail
+
 std::ostream& operator<<(std::ostream& lhs, const AccessLog& rhs) {
   namespace alog = castis::logger::accesslog;
   if (rhs.remote_addr_.empty())
@@ -105,40 +158,37 @@ std::ostream& operator<<(std::ostream& lhs, const AccessLog& rhs) {
   return lhs;
 }
 
+void set_access_stats(std::shared_ptr<access_stats> stats) {
+  auto previous =
+      std::atomic_exchange(&detail::current_access_stats, std::move(stats));
+  if (previous && previous != std::atomic_load(&detail::current_access_stats))
+    previous->write_summary();
+}
+
 boost::shared_ptr<cilog_async_sink_t> init_access_logger(
     const std::string& file_name, const std::string& target /* = "./log"*/,
-    int64_t rotation_size /* = 10 * 1024 * 1024*/) {
+    RotationPolicy rotation /* = 10 * 1024 * 1024*/,
+    FlushPolicy flush_policy /* = true*/, QueueOptions queue /* = {}*/,
+    std::shared_ptr<access_stats> stats /* = nullptr*/) {
   namespace expr = boost::log::expressions;
   boost::log::add_common_attributes();
   auto backend = boost::make_shared<cilog_backend>(
-      std::filesystem::path(target), file_name, rotation_size, true);
-  auto sink = boost::make_shared<cilog_async_sink_t>(backend);
-
-  // NCSA Combined Log Format
+      std::filesystem::path(target), file_name, rotation, flush_policy);
+  auto sink = boost::make_shared<cilog_async_sink_t>(
+      backend, keywords::queue_options = queue);
+  detail::set_idle_flush(sink.get(), flush_policy);
+  // a "dropped N records" line would break the access log readers, drops are
+  // only counted by sink->dropped_records() and sink->stats()
+
+  // NCSA Combined Log Format, see accesslog::kCombined
   // https://zetawiki.com/wiki/NCSA_%EB%A1%9C%EA%B7%B8_%ED%98%95%EC%8B%9D
-  sink->set_formatter(
-      expr::stream
-      << expr::attr<std::string, castisaccesslog_attr_tag>("remoteAddress")
-      << accesslog::kDelimiter
-      << expr::attr<std::string, castisaccesslog_attr_tag>("remoteIdent")
-      << accesslog::kDelimiter
-      << expr::attr<std::string, castisaccesslog_attr_tag>("userName")
-      << accesslog::kDelimiter
-      << expr::attr<std::string, castisaccesslog_attr_tag>("requestTime")
-      << accesslog::kDelimiter << accesslog::kQuotes
-      << expr::attr<std::string, castisaccesslog_attr_tag>("requestLine")
-      << accesslog::kQuotes << accesslog::kDelimiter
-      << expr::attr<unsigned, castisaccesslog_attr_tag>("status")
-      << accesslog::kDelimiter
-      << expr::attr<std::size_t, castisaccesslog_attr_tag>("contentLength")
-      << accesslog::kDelimiter << accesslog::kQuotes
-      << expr::attr<std::string, castisaccesslog_attr_tag>("referer")
-      << accesslog::kQuotes << accesslog::kDelimiter << accesslog::kQuotes
-      << expr::attr<std::string, castisaccesslog_attr_tag>("userAgent")
-      << accesslog::kQuotes);
-
-  sink->set_filter(expr::attr<std::string>("Channel") == "access");
+  sink->set_formatter(&format_message);
+
+  detail::set_telemetry_filter(
+      sink.get(), expr::attr<channel_id>("Channel") == kAccessChannel);
   boost::log::core::get()->add_sink(sink);
+  // without stats an aggregator attached earlier stays
+  if (stats) set_access_stats(std::move(stats));
   return sink;
 }
 
@@ -175,7 +225,7 @@ boost::log::formatting_ostream& operator<<(
     boost::log::to_log_manip<std::string, castisaccesslog_attr_tag> const&
         manip) {
   namespace alog = castis::logger::accesslog;
-  std::string value = manip.get();
+  std::string const& value = manip.get();
   if (value.empty())
     strm << alog::kEmpty;
   else
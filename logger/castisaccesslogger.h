@@ -1,39 +1,43 @@
 #pragma once
 
+#include <chrono>
+#include <memory>
 #include <string_view>
 
-#include <boost/log/utility/manipulators/add_value.hpp>
+#include <boost/log/utility/formatting_ostream.hpp>
+#include <boost/log/utility/manipulators/to_log.hpp>
 
+#include "castisaccessstats.h"
 #include "castislogger.h"
 
-#define ACCESSLOG(accesslog)                                             \
-  CIMLOG(access, info)                                                   \
-      << boost::log::add_value("remoteAddress", accesslog.remote_addr_)  \
-      << boost::log::add_value("remoteIdent", accesslog.remote_ident_)   \
-      << boost::log::add_value("userName", accesslog.user_name_)         \
-      << boost::log::add_value("requestTime", accesslog.request_time_)   \
-      << boost::log::add_value("requestLine", accesslog.request_line_)   \
-      << boost::log::add_value("status",                                 \
-                               static_cast<unsigned>(accesslog.status_)) \
-      << boost::log::add_value(                                          \
-             "contentLength",                                            \
-             static_cast<std::size_t>(accesslog.content_length_))        \
-      << boost::log::add_value("referer", accesslog.referer_)            \
-      << boost::log::add_value("userAgent", accesslog.user_agent_)       \
-      << boost::log::add_value(                                          \
-             "serveDuration",                                            \
-             static_cast<std::uint64_t>(accesslog.serve_duration_))      \
-      << accesslog;
-
+// Only ACCESSLOG writes to the access sink, so it does not register a
+// severity threshold and the statement is not checked against it. The
+// fields are copied into one buffer and the line is rendered by the sink.
+#define ACCESSLOG(access_log)                                           \
+  ::castis::logger::detail::push_access_log(                            \
+      CASTIS_CILOG_FORMAT_SITE("access", "access",                      \
+                               ::castis::logger::accesslog::kCombined), \
+      access_log)
+
+// Tag of the "remoteAddress", "status", ... attributes ACCESSLOG used to add.
+// It no longer adds them, the message of its record is the whole Combined
+// line (expr::smessage), see the Access Log section of README.md.
 struct castisaccesslog_attr_tag;
 
 namespace castis {
 namespace logger {
 namespace accesslog {
+// NCSA Combined Log Format, the fields of an AccessLog in order with "-" for
+// an empty field
+inline constexpr std::string_view kCombined =
+    "{} {} {} {} \"{}\" {} {} \"{}\" \"{}\"";
 
 std::string request_line(std::string_view method, std::string_view uri,
                          unsigned version_major = 1,
                          unsigned version_minor = 1);
+// Microseconds since the request was received
+std::uint64_t serve_duration(std::chrono::steady_clock::time_point req_start);
+// Microseconds since req_utc, follows changes of the wall clock
 std::uint64_t serve_duration(boost::posix_time::ptime req_utc);
 std::string request_time(boost::posix_time::ptime req_utc);
 }  // namespace accesslog
@@ -77,22 +81,40 @@ struct AccessLog {
 
 std::ostream& operator<<(std::ostream& strm, const AccessLog& accesslog);
 
+namespace detail {
+void push_access_log(FormatSite const& site, AccessLog const& accesslog);
+}  // namespace detail
+
+// Every ACCESSLOG statement is recorded by stats, nullptr detaches it. The
+// aggregator it replaces writes the summary of its last requests, call it
+// with nullptr before the sinks stop.
+void set_access_stats(std::shared_ptr<access_stats> stats);
+
+// Records dropped by QueueOptions::overflow_ are not noted in the access log,
+// see sink->dropped_records(). A non-null stats is attached with
+// set_access_stats, nullptr keeps the aggregator attached before.
 boost::shared_ptr<cilog_async_sink_t> init_access_logger(
     const std::string& file_name, const std::string& target = "./log",
-    int64_t rotation_size = 10 * 1024 * 1024);
+    RotationPolicy rotation = 10 * 1024 * 1024,
+    FlushPolicy flush_policy = true, QueueOptions queue = {},
+    std::shared_ptr<access_stats> stats = nullptr);
 
 }  // namespace logger
 }  // namespace castis
 
+// Format an empty field as "-"
+[[deprecated("ACCESSLOG no longer adds these attributes")]]
 boost::log::formatting_ostream& operator<<(
     boost::log::formatting_ostream& strm,
     boost::log::to_log_manip<unsigned, castisaccesslog_attr_tag> const& manip);
 
+[[deprecated("ACCESSLOG no longer adds these attributes")]]
 boost::log::formatting_ostream& operator<<(
     boost::log::formatting_ostream& strm,
     boost::log::to_log_manip<std::size_t, castisaccesslog_attr_tag> const&
         manip);
 
+[[deprecated("ACCESSLOG no longer adds these attributes")]]
 boost::log::formatting_ostream& operator<<(
     boost::log::formatting_ostream& strm,
     boost::log::to_log_manip<std::string, castisaccesslog_attr_tag> const&
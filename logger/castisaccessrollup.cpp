@@ -0,0 +1,167 @@
+#include "logger/castisaccessrollup.h"
+
+#include <algorithm>
+
+#include <boost/log/attributes/value_extraction.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/utility/setup/common_attributes.hpp>
+#include "fmt/chrono.h"
+
+namespace castis {
+namespace logger {
+namespace {
+const boost::log::attribute_name kFormatArgsAttr("FormatArgs");
+const boost::log::attribute_name kTimeStampAttr("TimeStamp");
+
+// The request line, status and content length of a record written by
+// detail::push_access_log, a "-" field is 0
+bool decode_access_log(detail::deferred_message const& message,
+                       std::string_view& request_line, unsigned& status,
+                       std::uint64_t& bytes) {
+  using detail::get_raw;
+  using detail::get_string;
+  char const* data = message.args_.data();
+  char const* end = data + message.args_.size();
+  auto string_field = [&](std::string_view& value) {
+    char tag = 0;
+    return get_raw(data, end, tag) && tag == detail::kArgString &&
+           get_string(data, end, value);
+  };
+  auto number_field = [&](std::uint64_t& value) {
+    char tag = 0;
+    if (!get_raw(data, end, tag)) return false;
+    value = 0;
+    if (tag == detail::kArgUint) return get_raw(data, end, value);
+    std::string_view empty;
+    return tag == detail::kArgString && get_string(data, end, empty);
+  };
+  std::string_view skipped;
+  for (int i = 0; i < 4; ++i) {
+    if (!string_field(skipped)) return false;
+  }
+  std::uint64_t status_field = 0;
+  if (!string_field(request_line) || !number_field(status_field) ||
+      !number_field(bytes)) {
+    return false;
+  }
+  status = static_cast<unsigned>(status_field);
+  return true;
+}
+}  // namespace
+
+access_rollup_backend::access_rollup_backend(
+    std::filesystem::path const& target_path, std::string_view file_name_suffix,
+    RotationPolicy const& rotation, FlushPolicy const& flush_policy,
+    AccessRollupOptions const& options)
+    : file_(target_path, file_name_suffix, rotation, flush_policy),
+      options_(options),
+      current_interval_(interval_index(std::time(nullptr))) {
+  file_.set_batching(true);
+}
+
+std::int64_t access_rollup_backend::interval_index(std::time_t time) const {
+  return static_cast<std::int64_t>(time) /
+         std::max<std::int64_t>(options_.interval_.count(), 1);
+}
+
+void access_rollup_backend::consume(boost::log::record_view const& rec) {
+  auto message =
+      boost::log::extract<detail::deferred_message>(kFormatArgsAttr, rec);
+  if (!message || message.get().format_ != accesslog::kCombined) return;
+  std::string_view request_line;
+  unsigned status = 0;
+  std::uint64_t bytes = 0;
+  if (!decode_access_log(message.get(), request_line, status, bytes)) return;
+
+  // a record of an interval that is already written, queued while the
+  // interval ended, is counted in the current one
+  auto interval = interval_index(record_time(rec));
+  if (interval > current_interval_) {
+    write_counters();
+    current_interval_ = interval;
+  }
+  last_record_ = rec;
+  detail::access_key(key_, request_line, status, options_.path_depth_);
+  auto it = counters_.find(key_);
+  if (it == counters_.end()) it = counters_.emplace(key_, counters()).first;
+  ++it->second.requests_;
+  it->second.bytes_ += bytes;
+}
+
+std::time_t access_rollup_backend::record_time(
+    boost::log::record_view const& rec) {
+  auto now = std::time(nullptr);
+  auto stamp =
+      boost::log::extract<boost::posix_time::ptime>(kTimeStampAttr, rec);
+  if (!stamp || stamp.get().is_special()) return now;
+  // the UTC offset is looked up once a minute instead of for every record
+  if (now < offset_time_ || now - offset_time_ >= 60) {
+    struct tm local;
+    localtime_r(&now, &local);
+    utc_offset_ = local.tm_gmtoff;
+    offset_time_ = now;
+  }
+  return boost::posix_time::to_time_t(stamp.get()) - utc_offset_;
+}
+
+void access_rollup_backend::flush() {
+  write_counters();
+  file_.flush();
+}
+
+void access_rollup_backend::flush_if_due() {
+  auto interval = interval_index(std::time(nullptr));
+  if (interval != current_interval_) {
+    write_counters();
+    current_interval_ = interval;
+  }
+  file_.flush_if_due();
+}
+
+void access_rollup_backend::write_counters() {
+  if (counters_.empty()) return;
+  auto interval = std::max<std::int64_t>(options_.interval_.count(), 1);
+  auto start = static_cast<std::time_t>(current_interval_ * interval);
+  auto time = fmt::format("{:%Y-%m-%d %H:%M:%S}", fmt::localtime(start));
+  std::string line;
+  for (auto const& [key, counter] : counters_) {
+    line.clear();
+    fmt::format_to(std::back_inserter(line), "{} {} requests={} bytes={}",
+                   time, key, counter.requests_, counter.bytes_);
+    file_.consume(last_record_, line);
+  }
+  counters_.clear();
+}
+
+boost::shared_ptr<cilog_access_rollup_sink_t> init_access_rollup_logger(
+    const std::string& file_name, const std::string& target /* = "./log"*/,
+    RotationPolicy rotation /* = 10 * 1024 * 1024*/,
+    FlushPolicy flush_policy /* = true*/, QueueOptions queue /* = {}*/,
+    AccessRollupOptions options /* = {}*/) {
+  namespace expr = boost::log::expressions;
+  boost::log::add_common_attributes();
+  auto backend = boost::make_shared<access_rollup_backend>(
+      std::filesystem::path(target), file_name, rotation, flush_policy,
+      options);
+  auto sink = boost::make_shared<cilog_access_rollup_sink_t>(
+      backend, keywords::queue_options = queue);
+  // an interval ends while no records arrive as well, the sink thread checks
+  // at least every second
+  auto idle_interval = std::chrono::milliseconds(std::chrono::seconds(1));
+  if (flush_policy.interval_.count() > 0) {
+    idle_interval = std::min(idle_interval, flush_policy.interval_);
+  }
+  sink->set_idle_handler(idle_interval, [sink = sink.get()] {
+    sink->locked_backend()->flush_if_due();
+  });
+
+  // log_every_ samples the access sink only, the rollup counts every request
+  sink->set_filter(expr::attr<channel_id>("Channel") == kAccessChannel ||
+                   expr::attr<channel_id>("Channel") ==
+                       kAccessUnsampledChannel);
+  boost::log::core::get()->add_sink(sink);
+  return sink;
+}
+
+}  // namespace logger
+}  // namespace castis
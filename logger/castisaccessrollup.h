@@ -0,0 +1,88 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+
+#include "castisaccesslogger.h"
+
+namespace castis {
+namespace logger {
+
+struct AccessRollupOptions {
+  // length of an interval, intervals start at multiples of it in UTC (on the
+  // minute for the default)
+  std::chrono::seconds interval_{60};
+  // path segments of the request uri kept in the key, 0 keys by the method
+  std::size_t path_depth_{1};
+};
+
+// Counts the ACCESSLOG records of each "<method> <path prefix> <N>xx" key
+// (see detail::access_key) and writes one line per key at the end of every
+// interval instead of a line per request:
+// "2018-09-05 16:48:00 GET /foo 2xx requests=120 bytes=4096000"
+// A request is counted in the interval of its statement's "TimeStamp", not
+// of the time the sink thread takes it from the queue.
+// Lines go through a cilog_backend, so files are named and rotated like the
+// ones of init_access_logger.
+class access_rollup_backend
+    : public boost::log::sinks::basic_sink_backend<
+          boost::log::sinks::combine_requirements<
+              boost::log::sinks::synchronized_feeding,
+              boost::log::sinks::flushing>::type> {
+ public:
+  access_rollup_backend(std::filesystem::path const& target_path,
+                        std::string_view file_name_suffix,
+                        RotationPolicy const& rotation,
+                        FlushPolicy const& flush_policy,
+                        AccessRollupOptions const& options);
+
+  void consume(boost::log::record_view const& rec);
+  // Writes the counters of the current interval as well, stop_logger does
+  // not lose the last partial interval
+  void flush();
+  // Writes the counters of an interval that has ended, called by the sink
+  // thread while no records arrive
+  void flush_if_due();
+
+ private:
+  struct counters {
+    std::uint64_t requests_{0};
+    std::uint64_t bytes_{0};
+  };
+
+  std::int64_t interval_index(std::time_t time) const;
+  // The record's "TimeStamp" attribute, the local time of the statement
+  std::time_t record_time(boost::log::record_view const& rec);
+  void write_counters();
+
+  cilog_backend file_;
+  AccessRollupOptions options_;
+  std::map<std::string, counters, std::less<>> counters_;
+  std::int64_t current_interval_{0};
+  std::time_t utc_offset_{0};
+  std::time_t offset_time_{0};
+  // written lines are passed with the last record, the file backend reads
+  // its severity for FlushPolicy::severity_
+  boost::log::record_view last_record_;
+  std::string key_;
+};
+
+using cilog_access_rollup_sink_t =
+    boost::log::sinks::asynchronous_sink<access_rollup_backend, cilog_queue>;
+
+// A sink on the access channel writing per interval counters, it can be
+// used instead of init_access_logger or next to it
+boost::shared_ptr<cilog_access_rollup_sink_t> init_access_rollup_logger(
+    const std::string& file_name, const std::string& target = "./log",
+    RotationPolicy rotation = 10 * 1024 * 1024,
+    FlushPolicy flush_policy = true, QueueOptions queue = {},
+    AccessRollupOptions options = {});
+
+}  // namespace logger
+}  // namespace castis
@@ -0,0 +1,257 @@
+#include "logger/castisaccessstats.h"
+
+#include <algorithm>
+#include <fstream>
+#include <utility>
+
+#include "logger/castisaccesslogger.h"
+
+namespace castis {
+namespace logger {
+namespace {
+std::atomic<std::uint64_t> next_generation{1};
+// the key of the requests past AccessStatsOptions::max_keys_
+const std::string kOtherKey = "other";
+}  // namespace
+
+namespace detail {
+void access_key(std::string& key, std::string_view request_line,
+                unsigned status, std::size_t path_depth) {
+  auto method_end = request_line.find(' ');
+  auto method = request_line.substr(0, method_end);
+  key.assign(method.empty() ? std::string_view("-") : method);
+  if (path_depth > 0 && method_end != std::string_view::npos) {
+    auto uri = request_line.substr(method_end + 1);
+    uri = uri.substr(0, std::min(uri.find(' '), uri.find('?')));
+    std::size_t end = 0;
+    for (std::size_t depth = 0; depth < path_depth && end < uri.size();
+         ++depth) {
+      end = std::min(uri.find('/', end + 1), uri.size());
+    }
+    key.push_back(' ');
+    key.append(uri.substr(0, end));
+  }
+  key.push_back(' ');
+  key.push_back(static_cast<char>('0' + status / 100 % 10));
+  key.append("xx");
+}
+
+std::size_t latency_histogram::bucket_index(std::uint64_t value) {
+  if (value < kSubBuckets) return static_cast<std::size_t>(value);
+  int bits = 64 - __builtin_clzll(value);
+  if (bits > kMaxBits) return kBuckets - 1;
+  int shift = bits - kSubBucketBits - 1;
+  return static_cast<std::size_t>(kSubBuckets * (shift + 1) +
+                                  (value >> shift) - kSubBuckets);
+}
+
+std::uint64_t latency_histogram::bucket_value(std::size_t index) {
+  if (index < kSubBuckets) return index;
+  auto shift = index / kSubBuckets - 1;
+  auto sub_bucket = index % kSubBuckets + kSubBuckets;
+  return ((sub_bucket + 1) << shift) - 1;
+}
+
+AccessStatsSummary summarize(std::string key,
+                             std::vector<std::uint64_t> const& counts) {
+  AccessStatsSummary summary;
+  summary.key_ = std::move(key);
+  for (std::size_t i = 0; i < latency_histogram::kBuckets; ++i) {
+    summary.count_ += counts[i];
+  }
+  summary.max_ = counts[latency_histogram::kBuckets];
+  if (summary.count_ == 0) return summary;
+
+  auto percentile = [&](std::uint64_t per_mille) {
+    // the smallest value with at least per_mille of the requests at or below
+    auto rank = (summary.count_ * per_mille + 999) / 1000;
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < latency_histogram::kBuckets; ++i) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return std::min(latency_histogram::bucket_value(i), summary.max_);
+      }
+    }
+    return summary.max_;
+  };
+  summary.p50_ = percentile(500);
+  summary.p99_ = percentile(990);
+  summary.p999_ = percentile(999);
+  return summary;
+}
+}  // namespace detail
+
+access_stats::access_stats(AccessStatsOptions options)
+    : options_(std::move(options)), generation_(next_generation++) {
+  if (options_.interval_.count() > 0) {
+    worker_ = std::thread(&access_stats::run, this);
+  }
+}
+
+access_stats::~access_stats() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  if (worker_.joinable()) worker_.join();
+  // often run during static destruction through current_access_stats, when
+  // the sinks may be gone already
+  if (!options_.summary_path_.empty()) write_summary();
+}
+
+// A thread records into the histograms of the aggregator it saw last, a
+// new aggregator gets new ones. Those of a thread that has exited or moved
+// on are folded into retired_ by the next merge or new thread.
+access_stats::thread_histograms& access_stats::this_thread_histograms() {
+  struct cache {
+    ~cache() { release(); }
+    void release() {
+      if (histograms_) {
+        histograms_->exited_.store(true, std::memory_order_release);
+      }
+    }
+
+    std::uint64_t generation_{0};
+    std::shared_ptr<thread_histograms> histograms_;
+  };
+  thread_local cache current;
+  if (current.generation_ != generation_) {
+    current.release();
+    current.histograms_ = std::make_shared<thread_histograms>();
+    current.generation_ = generation_;
+    std::lock_guard<std::mutex> lock(threads_mutex_);
+    fold_exited_threads();
+    threads_.push_back(current.histograms_);
+  }
+  return *current.histograms_;
+}
+
+void access_stats::record(AccessLog const& accesslog) {
+  auto& histograms = this_thread_histograms();
+  thread_local std::string key;
+  detail::access_key(key, accesslog.request_line_, accesslog.status_,
+                     options_.path_depth_);
+  auto it = histograms.histograms_.find(key);
+  if (it == histograms.histograms_.end()) {
+    if (!admit_key(key)) {
+      key.assign(kOtherKey);
+      it = histograms.histograms_.find(key);
+    }
+    if (it == histograms.histograms_.end()) {
+      std::lock_guard<std::mutex> lock(histograms.mutex_);
+      it = histograms.histograms_
+               .emplace(key, std::make_unique<detail::latency_histogram>())
+               .first;
+    }
+  }
+  it->second->record(accesslog.serve_duration_);
+}
+
+bool access_stats::admit_key(std::string const& key) {
+  std::lock_guard<std::mutex> lock(keys_mutex_);
+  if (keys_.count(key) > 0) return true;
+  if (keys_.size() >= options_.max_keys_) return false;
+  keys_.insert(key);
+  return true;
+}
+
+void access_stats::add_counts(merged_counts& merged,
+                              thread_histograms& thread) {
+  std::lock_guard<std::mutex> lock(thread.mutex_);
+  for (auto const& [key, histogram] : thread.histograms_) {
+    auto& counts = merged[key];
+    counts.resize(detail::latency_histogram::kBuckets + 1);
+    for (std::size_t i = 0; i < detail::latency_histogram::kBuckets; ++i) {
+      counts[i] += histogram->counts_[i].load(std::memory_order_relaxed);
+    }
+    auto& max = counts[detail::latency_histogram::kBuckets];
+    max = std::max(max, histogram->max_.load(std::memory_order_relaxed));
+  }
+}
+
+void access_stats::fold_exited_threads() {
+  auto exited = std::partition(
+      threads_.begin(), threads_.end(), [](auto const& thread) {
+        return !thread->exited_.load(std::memory_order_acquire);
+      });
+  for (auto it = exited; it != threads_.end(); ++it) {
+    add_counts(retired_, **it);
+  }
+  threads_.erase(exited, threads_.end());
+}
+
+access_stats::merged_counts access_stats::merge() {
+  std::vector<std::shared_ptr<thread_histograms>> threads;
+  merged_counts merged;
+  {
+    std::lock_guard<std::mutex> lock(threads_mutex_);
+    fold_exited_threads();
+    merged = retired_;
+    threads = threads_;
+  }
+  for (auto const& thread : threads) add_counts(merged, *thread);
+  return merged;
+}
+
+std::vector<AccessStatsSummary> access_stats::snapshot() {
+  std::vector<AccessStatsSummary> summaries;
+  for (auto const& [key, counts] : merge()) {
+    summaries.push_back(detail::summarize(key, counts));
+  }
+  return summaries;
+}
+
+void access_stats::write_summary() {
+  std::lock_guard<std::mutex> lock(summary_mutex_);
+  auto merged = merge();
+  std::string lines;
+  for (auto& [key, counts] : merged) {
+    // the requests since the last summary
+    constexpr auto kBuckets = detail::latency_histogram::kBuckets;
+    auto delta = counts;
+    auto last = summarized_.find(key);
+    if (last != summarized_.end()) {
+      for (std::size_t i = 0; i < kBuckets; ++i) delta[i] -= last->second[i];
+    }
+    // the maximum of the interval is the top of its highest bucket, the
+    // overall one only when it falls into that bucket
+    for (auto i = kBuckets; i-- > 0;) {
+      if (delta[i] == 0) continue;
+      delta[kBuckets] = std::min(detail::latency_histogram::bucket_value(i),
+                                 counts[kBuckets]);
+      break;
+    }
+    auto summary = detail::summarize(key, delta);
+    if (summary.count_ == 0) continue;
+    auto line = fmt::format(
+        "access_stats {} count={} p50={}us p99={}us p999={}us max={}us",
+        summary.key_, summary.count_, summary.p50_, summary.p99_,
+        summary.p999_, summary.max_);
+    if (options_.summary_path_.empty()) {
+      CILOG(info, "{}", line);
+    } else {
+      lines += line;
+      lines.push_back('\n');
+    }
+  }
+  summarized_ = std::move(merged);
+  if (lines.empty()) return;
+  std::error_code ec;
+  std::filesystem::create_directories(options_.summary_path_.parent_path(), ec);
+  std::ofstream file(options_.summary_path_, std::ios::app);
+  file << lines;
+}
+
+void access_stats::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!cond_.wait_for(lock, options_.interval_,
+                         [this] { return stopping_; })) {
+    lock.unlock();
+    write_summary();
+    lock.lock();
+  }
+}
+
+}  // namespace logger
+}  // namespace castis
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace castis {
+namespace logger {
+
+struct AccessLog;
+
+struct AccessStatsOptions {
+  // path segments of the request uri kept in the key, 0 keys by the method
+  std::size_t path_depth_{1};
+  // distinct keys counted, the requests of any further key are counted as
+  // "other" so random uris cannot grow the histograms without bound
+  std::size_t max_keys_{256};
+  // how often the summary of the requests since the last one is written,
+  // 0 only writes it when write_summary is called
+  std::chrono::seconds interval_{60};
+  // summary lines are appended to this file, or logged with CILOG(info)
+  // when it is empty
+  std::filesystem::path summary_path_;
+  // every Nth ACCESSLOG statement is written to the access sink, 0 writes
+  // none. The statistics and the rollup sink count every request.
+  std::size_t log_every_{1};
+};
+
+namespace detail {
+// "<method> <first path_depth segments of the uri> <N>xx", the key of the
+// access statistics: "GET /foo 2xx" of "GET /foo/bar?x=1 HTTP/1.1" and 200
+void access_key(std::string& key, std::string_view request_line,
+                unsigned status, std::size_t path_depth);
+
+// Serve durations in microseconds counted in log-linear buckets, 32 per
+// power of two so a reported value is within about 3% of the recorded one.
+// Only the owning thread records, readers merge the counters without a lock.
+class latency_histogram {
+ public:
+  static constexpr int kSubBucketBits = 5;
+  static constexpr std::uint64_t kSubBuckets = 1 << kSubBucketBits;
+  // values from 2^40us (about 12 days) up share the last bucket
+  static constexpr int kMaxBits = 40;
+  static constexpr std::size_t kBuckets =
+      kSubBuckets * (kMaxBits - kSubBucketBits + 1);
+
+  static std::size_t bucket_index(std::uint64_t value);
+  // The highest value counted in the bucket
+  static std::uint64_t bucket_value(std::size_t index);
+
+  void record(std::uint64_t value) {
+    auto& count = counts_[bucket_index(value)];
+    count.store(count.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+    if (value > max_.load(std::memory_order_relaxed)) {
+      max_.store(value, std::memory_order_relaxed);
+    }
+  }
+
+  std::array<std::atomic<std::uint64_t>, kBuckets> counts_{};
+  std::atomic<std::uint64_t> max_{0};
+};
+}  // namespace detail
+
+// Latency of the requests of one key: "<method> <path prefix> <N>xx"
+struct AccessStatsSummary {
+  std::string key_;
+  std::uint64_t count_{0};
+  std::uint64_t p50_{0};
+  std::uint64_t p99_{0};
+  std::uint64_t p999_{0};
+  std::uint64_t max_{0};
+};
+
+// Aggregates the serve_duration_ of every ACCESSLOG statement into per
+// thread histograms, so percentiles are available without parsing the
+// access logs and the logs themselves can be sampled with log_every_.
+class access_stats {
+ public:
+  explicit access_stats(AccessStatsOptions options = {});
+  // Writes the summary of the requests not summarized yet to summary_path_,
+  // it is not logged with CILOG. set_access_stats writes it when the
+  // aggregator is replaced or detached.
+  ~access_stats();
+  access_stats(access_stats const&) = delete;
+  access_stats& operator=(access_stats const&) = delete;
+
+  // Called by ACCESSLOG on the logging thread
+  void record(AccessLog const& accesslog);
+
+  // Percentiles of every request recorded so far, by key
+  std::vector<AccessStatsSummary> snapshot();
+  // Writes "access_stats <key> count=N p50=Nus p99=Nus p999=Nus max=Nus"
+  // for every key with requests since the last summary, max is the largest
+  // of those requests within the precision of the histogram
+  void write_summary();
+
+  AccessStatsOptions const& options() const { return options_; }
+
+ private:
+  struct thread_histograms {
+    // taken by the owner to add a key and by the readers
+    std::mutex mutex_;
+    std::unordered_map<std::string,
+                       std::unique_ptr<detail::latency_histogram>>
+        histograms_;
+    // set once the owner no longer records, the histograms are folded into
+    // retired_ and freed
+    std::atomic<bool> exited_{false};
+  };
+  // the bucket counts of a key followed by its maximum
+  using merged_counts = std::map<std::string, std::vector<std::uint64_t>>;
+
+  thread_histograms& this_thread_histograms();
+  // false once max_keys_ other keys are counted
+  bool admit_key(std::string const& key);
+  static void add_counts(merged_counts& merged, thread_histograms& thread);
+  // called with threads_mutex_ held
+  void fold_exited_threads();
+  merged_counts merge();
+  void run();
+
+  const AccessStatsOptions options_;
+  const std::uint64_t generation_;
+
+  std::mutex threads_mutex_;
+  std::vector<std::shared_ptr<thread_histograms>> threads_;
+  // counts of the threads that have exited
+  merged_counts retired_;
+
+  std::mutex keys_mutex_;
+  std::unordered_set<std::string> keys_;
+
+  // counts at the last summary, owned by write_summary
+  std::mutex summary_mutex_;
+  merged_counts summarized_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stopping_{false};
+  std::thread worker_;
+};
+
+namespace detail {
+// The percentiles of kBuckets bucket counts followed by the maximum
+AccessStatsSummary summarize(std::string key,
+                             std::vector<std::uint64_t> const& counts);
+}  // namespace detail
+
+}  // namespace logger
+}  // namespace castis
@@ -0,0 +1,97 @@
+#include "logger/castisargs.h"
+
+#include "fmt/args.h"
+
+namespace castis {
+namespace logger {
+namespace detail {
+void format_encoded(fmt::memory_buffer& out, std::string_view format,
+                    char const*& data, char const* end) {
+  // strings are stored as views into data, clear() keeps the capacity
+  thread_local fmt::dynamic_format_arg_store<fmt::format_context> store;
+  store.clear();
+  bool ok = true;
+  while (ok && data < end) {
+    char tag = *data++;
+    switch (tag) {
+      case kArgBool:
+      case kArgChar: {
+        char value = 0;
+        ok = get_raw(data, end, value);
+        if (tag == kArgBool) {
+          store.push_back(value != 0);
+        } else {
+          store.push_back(value);
+        }
+        break;
+      }
+      case kArgInt: {
+        std::int64_t value = 0;
+        ok = get_raw(data, end, value);
+        store.push_back(value);
+        break;
+      }
+      case kArgUint: {
+        std::uint64_t value = 0;
+        ok = get_raw(data, end, value);
+        store.push_back(value);
+        break;
+      }
+      case kArgFloat: {
+        float value = 0;
+        ok = get_raw(data, end, value);
+        store.push_back(value);
+        break;
+      }
+      case kArgDouble: {
+        double value = 0;
+        ok = get_raw(data, end, value);
+        store.push_back(value);
+        break;
+      }
+      case kArgString: {
+        std::string_view value;
+        ok = get_string(data, end, value);
+        store.push_back(fmt::string_view(value.data(), value.size()));
+        break;
+      }
+      case kArgPointer: {
+        std::uint64_t value = 0;
+        ok = get_raw(data, end, value);
+        store.push_back(reinterpret_cast<void const*>(value));
+        break;
+      }
+      default:
+        ok = false;
+    }
+  }
+  if (!ok) {
+    data = end;
+    fmt::format_to(std::back_inserter(out), "{} <malformed arguments>",
+                   format);
+    return;
+  }
+  auto start = out.size();
+  try {
+    fmt::vformat_to(std::back_inserter(out),
+                    fmt::string_view(format.data(), format.size()), store);
+  } catch (fmt::format_error const& e) {
+    out.resize(start);
+    fmt::format_to(std::back_inserter(out), "{} <{}>", format, e.what());
+  }
+}
+
+fmt::memory_buffer& thread_format_buffer() {
+  thread_local fmt::memory_buffer buffer;
+  buffer.clear();
+  return buffer;
+}
+
+std::string& thread_encode_buffer() {
+  thread_local std::string buffer;
+  buffer.clear();
+  return buffer;
+}
+}  // namespace detail
+}  // namespace logger
+}  // namespace castis
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "fmt/format.h"
+
+namespace castis {
+namespace logger {
+namespace detail {
+// Format arguments copied out of a CILOG(level, "fmt {}", args...) statement
+// so they can be formatted later, on the sink thread or by cilog-decode.
+// Arguments are encoded as a tag byte and the raw value, strings as a 32 bit
+// length and the bytes.
+enum arg_tag : char {
+  kArgBool = 'b',
+  kArgChar = 'c',
+  kArgInt = 'i',
+  kArgUint = 'u',
+  kArgFloat = 'f',
+  kArgDouble = 'd',
+  kArgString = 's',
+  kArgPointer = 'p',
+};
+
+// The types encode_arg keeps as values, a format spec applies to them the
+// same way as to the original argument
+template <typename T, typename U = std::decay_t<T>>
+inline constexpr bool encodable_arg_v =
+    (std::is_arithmetic_v<U> && !std::is_same_v<U, long double>) ||
+    std::is_same_v<U, void const*> ||
+    std::is_same_v<U, void*> ||
+    std::is_convertible_v<U const&, std::string_view>;
+
+template <typename T>
+void put_raw(std::string& out, T value) {
+  out.append(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+inline void put_string(std::string& out, std::string_view value) {
+  put_raw(out, static_cast<std::uint32_t>(value.size()));
+  out.append(value.data(), value.size());
+}
+
+template <typename T>
+bool get_raw(char const*& data, char const* end, T& value) {
+  if (static_cast<std::size_t>(end - data) < sizeof(value)) return false;
+  std::memcpy(&value, data, sizeof(value));
+  data += sizeof(value);
+  return true;
+}
+
+inline bool get_string(char const*& data, char const* end,
+                       std::string_view& value) {
+  std::uint32_t size = 0;
+  if (!get_raw(data, end, size)) return false;
+  if (static_cast<std::size_t>(end - data) < size) return false;
+  value = std::string_view(data, size);
+  data += size;
+  return true;
+}
+
+// Types the codec does not know are formatted with "{}" and stored as
+// strings, the spec of a statement would then apply to the string, so
+// log_deferred and binary_log let the caller format such statements
+template <typename T>
+void encode_arg(std::string& out, T const& value) {
+  using U = std::decay_t<T>;
+  if constexpr (std::is_same_v<U, bool>) {
+    out.push_back(kArgBool);
+    out.push_back(value ? 1 : 0);
+  } else if constexpr (std::is_same_v<U, char>) {
+    out.push_back(kArgChar);
+    out.push_back(value);
+  } else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>) {
+    out.push_back(kArgInt);
+    put_raw(out, static_cast<std::int64_t>(value));
+  } else if constexpr (std::is_integral_v<U>) {
+    out.push_back(kArgUint);
+    put_raw(out, static_cast<std::uint64_t>(value));
+  } else if constexpr (std::is_same_v<U, float>) {
+    out.push_back(kArgFloat);
+    put_raw(out, value);
+  } else if constexpr (std::is_floating_point_v<U>) {
+    out.push_back(kArgDouble);
+    put_raw(out, static_cast<double>(value));
+  } else if constexpr (std::is_convertible_v<U const&, std::string_view>) {
+    out.push_back(kArgString);
+    put_string(out, std::string_view(value));
+  } else if constexpr (std::is_pointer_v<U>) {
+    out.push_back(kArgPointer);
+    put_raw(out, reinterpret_cast<std::uint64_t>(value));
+  } else {
+    out.push_back(kArgString);
+    put_string(out, fmt::format("{}", value));
+  }
+}
+
+template <typename... Args>
+void encode_args(std::string& out, Args const&... args) {
+  (encode_arg(out, args), ...);
+}
+
+// Formats encoded arguments with the site's format string into out, data is
+// advanced past them. A malformed entry or format is rendered as the format
+// string followed by the error.
+void format_encoded(fmt::memory_buffer& out, std::string_view format,
+                    char const*& data, char const* end);
+
+// Per thread scratch buffers, returned empty. They keep the capacity of the
+// longest message so formatting a line does not allocate once a thread has
+// warmed up.
+fmt::memory_buffer& thread_format_buffer();
+std::string& thread_encode_buffer();
+}  // namespace detail
+}  // namespace logger
+}  // namespace castis
@@ -0,0 +1,411 @@
+#include "logger/castisbinlog.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <istream>
+#include <iterator>
+#include <ostream>
+
+#include "fmt/chrono.h"
+
+namespace fs = std::filesystem;
+
+namespace castis {
+namespace logger {
+namespace {
+// File layout: the magic, an 'H' entry with the app name and version, then
+// 'S' entries defining a format site before its first 'R' record in the file
+constexpr std::string_view kMagic("CILOGB1\n");
+constexpr char kHeaderEntry = 'H';
+constexpr char kSiteEntry = 'S';
+constexpr char kRecordEntry = 'R';
+
+struct thread_buffer_registry {
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<detail::binary_thread_buffer>> buffers_;
+};
+
+thread_buffer_registry& thread_buffers() {
+  static thread_buffer_registry registry;
+  return registry;
+}
+
+// Wakes the writer before its interval when a thread waits on a full buffer
+struct writer_wakeup {
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool wanted_{false};
+};
+
+writer_wakeup& wakeup() {
+  static writer_wakeup wakeup;
+  return wakeup;
+}
+
+void wake_writer() {
+  auto& w = wakeup();
+  {
+    std::lock_guard<std::mutex> lock(w.mutex_);
+    w.wanted_ = true;
+  }
+  w.cond_.notify_one();
+}
+
+// Registers the thread's buffer on its first entry, the writer drops it
+// once the thread has exited and its entries are written
+struct thread_buffer_holder {
+  thread_buffer_holder()
+      : buffer_(std::make_shared<detail::binary_thread_buffer>()) {
+    buffer_->tid_ = static_cast<std::uint32_t>(syscall(SYS_gettid));
+    auto& registry = thread_buffers();
+    std::lock_guard<std::mutex> lock(registry.mutex_);
+    registry.buffers_.push_back(buffer_);
+  }
+  ~thread_buffer_holder() { buffer_->retired_ = true; }
+
+  std::shared_ptr<detail::binary_thread_buffer> buffer_;
+};
+
+template <typename T>
+bool read_raw(std::istream& in, T& value) {
+  return static_cast<bool>(
+      in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+// Grows value with what is read, a corrupt size does not allocate more than
+// the file holds
+bool read_bytes(std::istream& in, std::string& value, std::uint32_t size) {
+  constexpr std::size_t kChunk = 64 * 1024;
+  value.clear();
+  while (value.size() < size) {
+    auto offset = value.size();
+    auto chunk = std::min<std::size_t>(size - offset, kChunk);
+    value.resize(offset + chunk);
+    if (!in.read(&value[offset], static_cast<std::streamsize>(chunk))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool read_string(std::istream& in, std::string& value) {
+  std::uint32_t size = 0;
+  return read_raw(in, size) && read_bytes(in, value, size);
+}
+
+// "YYYY-MM-DD,HH:MM:SS.ffffff" in local time, as format_timestamp writes it
+void append_timestamp(std::string& out, std::int64_t micros) {
+  auto seconds = static_cast<std::time_t>(micros / 1000000);
+  tm local;
+  localtime_r(&seconds, &local);
+  fmt::format_to(std::back_inserter(out),
+                 "{:04}-{:02}-{:02},{:02}:{:02}:{:02}.{:06}",
+                 local.tm_year + 1900, local.tm_mon + 1, local.tm_mday,
+                 local.tm_hour, local.tm_min, local.tm_sec, micros % 1000000);
+}
+}  // namespace
+
+namespace detail {
+binary_thread_buffer& this_thread_binary_buffer() {
+  thread_local thread_buffer_holder holder;
+  return *holder.buffer_;
+}
+
+void wait_binary_buffer(binary_thread_buffer& buffer) {
+  wake_writer();
+  std::unique_lock<std::mutex> lock(buffer.mutex_);
+  buffer.drained_.wait(lock, [&buffer] {
+    return buffer.data_.size() < binary_thread_buffer::kMaxPending ||
+           !binary_log_active.load(std::memory_order_relaxed);
+  });
+}
+}  // namespace detail
+
+binary_logger::binary_logger(std::string app_name, std::string app_version,
+                             std::filesystem::path const& target,
+                             RotationPolicy const& rotation)
+    : app_name_(std::move(app_name)),
+      app_version_(std::move(app_version)),
+      target_path_(target),
+      rotation_size_(rotation.size_),
+      schedule_(rotation.interval_) {
+  detail::binary_log_active = true;
+  writer_ = std::thread(&binary_logger::run, this);
+}
+
+binary_logger::~binary_logger() { stop(); }
+
+void binary_logger::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_) return;
+    // off before the writer can see stopping_, its last pass then takes
+    // every entry appended while the flag was on
+    detail::binary_log_active = false;
+    stopping_ = true;
+  }
+  wake_writer();
+  writer_.join();
+  close_file();
+}
+
+void binary_logger::run() {
+  auto& w = wakeup();
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(w.mutex_);
+      w.cond_.wait_for(lock, std::chrono::milliseconds(10),
+                       [&w] { return w.wanted_; });
+      w.wanted_ = false;
+    }
+    bool stopping = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping = stopping_;
+    }
+    // the last pass takes what was logged until binary_log_active went off
+    write_out();
+    if (stopping) return;
+  }
+}
+
+// Takes every thread's buffer, orders the entries by time and writes them
+void binary_logger::write_out() {
+  struct entry {
+    std::int64_t time_;
+    char const* data_;
+    std::size_t size_;
+    std::uint32_t tid_;
+  };
+  std::vector<std::shared_ptr<detail::binary_thread_buffer>> buffers;
+  {
+    auto& registry = thread_buffers();
+    std::lock_guard<std::mutex> lock(registry.mutex_);
+    buffers = registry.buffers_;
+  }
+
+  std::vector<entry> entries;
+  for (auto& buffer : buffers) {
+    {
+      std::lock_guard<std::mutex> lock(buffer->mutex_);
+      buffer->taken_.clear();
+      buffer->data_.swap(buffer->taken_);
+    }
+    buffer->drained_.notify_all();
+    char const* data = buffer->taken_.data();
+    char const* end = data + buffer->taken_.size();
+    while (static_cast<std::size_t>(end - data) >=
+           detail::binary_thread_buffer::kEntryHeaderSize) {
+      std::int64_t time = 0;
+      std::uint32_t size = 0;
+      std::memcpy(&time, data + detail::binary_thread_buffer::kTimeOffset,
+                  sizeof(time));
+      std::memcpy(&size, data + detail::binary_thread_buffer::kLengthOffset,
+                  sizeof(size));
+      auto entry_size = detail::binary_thread_buffer::kEntryHeaderSize + size;
+      entries.push_back({time, data, entry_size, buffer->tid_});
+      data += entry_size;
+    }
+  }
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](entry const& a, entry const& b) {
+                     return a.time_ < b.time_;
+                   });
+
+  auto now = std::chrono::steady_clock::now();
+  for (auto const& e : entries) {
+    if (file_ && (file_size_ + pending_.size() >= rotation_size_ ||
+                  schedule_.due(now))) {
+      close_file();
+    }
+    if (!file_) open_file();
+    if (!file_) break;
+
+    std::uint32_t id = 0;
+    std::memcpy(&id, e.data_, sizeof(id));
+    if (id >= defined_sites_.size()) defined_sites_.resize(id + 1);
+    if (!defined_sites_[id]) {
+      auto const* site = detail::format_site(id);
+      if (!site) continue;
+      pending_.push_back(kSiteEntry);
+      detail::put_raw(pending_, id);
+      detail::put_string(pending_, site->site_.prefix_);
+      detail::put_string(pending_, site->site_.module_);
+      detail::put_string(pending_, site->format_);
+      defined_sites_[id] = true;
+    }
+    // the thread buffer entry with the tid inserted before the length
+    pending_.push_back(kRecordEntry);
+    pending_.append(e.data_, detail::binary_thread_buffer::kLengthOffset);
+    detail::put_raw(pending_, e.tid_);
+    pending_.append(e.data_ + detail::binary_thread_buffer::kLengthOffset,
+                    e.size_ - detail::binary_thread_buffer::kLengthOffset);
+  }
+  write_pending();
+  if (file_) file_->flush();
+
+  // buffers of exited threads are dropped once they are written out
+  auto& registry = thread_buffers();
+  std::lock_guard<std::mutex> lock(registry.mutex_);
+  auto& all = registry.buffers_;
+  all.erase(std::remove_if(all.begin(), all.end(),
+                           [](auto const& buffer) {
+                             std::lock_guard<std::mutex> lock(buffer->mutex_);
+                             return buffer->retired_ && buffer->data_.empty();
+                           }),
+            all.end());
+}
+
+// A binary file is never appended to, its site ids belong to one process
+void binary_logger::open_file() {
+  schedule_.start();
+  auto start = schedule_.interval_start();
+  tm local;
+  localtime_r(&start, &local);
+  auto prefix = fmt::format("{:%Y-%m-%d}", local);
+  auto monthly_path = target_path_ / fmt::format("{:%Y-%m}", local);
+  if (prefix != index_prefix_) {
+    index_prefix_ = prefix;
+    next_index_ = 0;
+  }
+  std::error_code ec;
+  fs::create_directories(monthly_path, ec);
+  for (;; ++next_index_) {
+    file_path_ =
+        monthly_path /
+        (next_index_ > 0
+             ? fmt::format("{}[{}]_{}.clog", prefix, next_index_, app_name_)
+             : fmt::format("{}_{}.clog", prefix, app_name_));
+    if (!fs::exists(file_path_, ec)) break;
+  }
+  ++next_index_;
+
+  file_ = std::make_unique<std::ofstream>(file_path_, std::ios::binary);
+  if (!file_->is_open()) {
+    file_.reset();
+    return;
+  }
+  pending_.assign(kMagic.data(), kMagic.size());
+  pending_.push_back(kHeaderEntry);
+  detail::put_string(pending_, app_name_);
+  detail::put_string(pending_, app_version_);
+  file_size_ = 0;
+  write_pending();
+  defined_sites_.assign(defined_sites_.size(), false);
+
+  auto link_path = target_path_ / (app_name_ + ".clog");
+  fs::remove(link_path, ec);
+  fs::create_symlink(fs::absolute(file_path_), link_path, ec);
+}
+
+void binary_logger::write_pending() {
+  if (file_ && !pending_.empty()) {
+    file_->write(pending_.data(),
+                 static_cast<std::streamsize>(pending_.size()));
+    file_size_ += pending_.size();
+  }
+  pending_.clear();
+}
+
+void binary_logger::close_file() {
+  if (!file_) return;
+  write_pending();
+  file_->close();
+  file_.reset();
+}
+
+std::shared_ptr<binary_logger> init_binary_logger(
+    std::string app_name, std::string app_version,
+    std::string_view target /* = "./log"*/,
+    RotationPolicy rotation /* = 10 * 1024 * 1024*/) {
+  auto logger = std::make_shared<binary_logger>(
+      std::move(app_name), std::move(app_version), fs::path(target), rotation);
+  detail::set_sink_threshold(logger.get(), foo);
+  return logger;
+}
+
+void stop_logger(std::shared_ptr<binary_logger> logger) {
+  detail::remove_sink_threshold(logger.get());
+  logger->stop();
+}
+
+bool decode_binary_log(std::istream& in, std::ostream& out) {
+  std::string magic(kMagic.size(), '\0');
+  if (!in.read(&magic[0], static_cast<std::streamsize>(magic.size())) ||
+      magic != kMagic) {
+    return false;
+  }
+
+  struct site {
+    std::string prefix_;
+    std::string module_;
+    std::string format_;
+  };
+  std::vector<site> sites;
+  std::string app_name;
+  std::string app_version;
+  std::string args;
+  std::string line;
+  for (char type = 0; in.get(type);) {
+    if (type == kHeaderEntry) {
+      if (!read_string(in, app_name) || !read_string(in, app_version)) {
+        return false;
+      }
+    } else if (type == kSiteEntry) {
+      std::uint32_t id = 0;
+      site s;
+      if (!read_raw(in, id) || !read_string(in, s.prefix_) ||
+          !read_string(in, s.module_) || !read_string(in, s.format_)) {
+        return false;
+      }
+      if (id >= sites.size()) sites.resize(id + 1);
+      sites[id] = std::move(s);
+    } else if (type == kRecordEntry) {
+      std::uint32_t id = 0;
+      std::uint8_t level = 0;
+      std::int64_t time = 0;
+      std::uint32_t tid = 0;
+      std::uint32_t size = 0;
+      if (!read_raw(in, id) || !read_raw(in, level) || !read_raw(in, time) ||
+          !read_raw(in, tid) || !read_raw(in, size) ||
+          !read_bytes(in, args, size) || id >= sites.size()) {
+        return false;
+      }
+      auto const& s = sites[id];
+      bool formatted =
+          (level & detail::binary_thread_buffer::kFormattedLevel) != 0;
+      level &= ~detail::binary_thread_buffer::kFormattedLevel;
+
+      line.clear();
+      fmt::format_to(std::back_inserter(line), "{},{},", app_name,
+                     app_version);
+      append_timestamp(line, time);
+      auto name = detail::severity_name(static_cast<severity_level>(level));
+      if (name) {
+        fmt::format_to(std::back_inserter(line), ",{},", name);
+      } else {
+        fmt::format_to(std::back_inserter(line), ",{},",
+                       static_cast<int>(level));
+      }
+      fmt::format_to(std::back_inserter(line), "{}{}{}", s.prefix_, tid,
+                     s.module_);
+      char const* data = args.data();
+      auto& message = detail::thread_format_buffer();
+      // the caller formatted the message, it is written as it is
+      detail::format_encoded(message, formatted ? "{}" : s.format_, data,
+                             data + args.size());
+      line.append(message.data(), message.size());
+      line.push_back('\n');
+      out.write(line.data(), static_cast<std::streamsize>(line.size()));
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace logger
+}  // namespace castis
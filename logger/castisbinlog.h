@@ -0,0 +1,176 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iosfwd>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "logger/castisargs.h"
+#include "logger/castislogger.h"
+
+namespace castis {
+namespace logger {
+namespace detail {
+// Per thread staging buffer of binary entries, the writer thread swaps it
+// out. The lock is only contended while the writer takes the buffer.
+struct binary_thread_buffer {
+  // u32 site id, u8 level, i64 time, u32 length of the encoded arguments
+  static constexpr std::size_t kEntryHeaderSize = 17;
+  static constexpr std::size_t kTimeOffset = 5;
+  static constexpr std::size_t kLengthOffset = 13;
+  // set in the level of an entry whose argument is the message formatted by
+  // the caller, a statement with an argument that is not encodable_arg_v
+  static constexpr std::uint8_t kFormattedLevel = 0x80;
+  // a producer waits while this much is not written out yet
+  static constexpr std::size_t kMaxPending = 4 * 1024 * 1024;
+
+  std::mutex mutex_;
+  std::condition_variable drained_;
+  std::string data_;
+  // the entries the writer took last, its capacity goes back to data_
+  std::string taken_;
+  std::uint32_t tid_{0};
+  std::atomic<bool> retired_{false};
+};
+
+inline std::atomic<bool> binary_log_active{false};
+
+binary_thread_buffer& this_thread_binary_buffer();
+// Waits until the writer has taken the calling thread's entries
+void wait_binary_buffer(binary_thread_buffer& buffer);
+
+// Appends an entry (site id, level, microseconds since the epoch, length,
+// arguments) to the calling thread's buffer. False when no binary logger
+// runs or the statement is not on the default channel, it is then written
+// as a text record.
+template <typename... Args>
+bool binary_log(FormatSite const& site, severity_level level,
+                Args const&... args) {
+  if (!binary_log_active.load(std::memory_order_relaxed)) return false;
+  // the module loggers filter CIMLOG statements of other channels
+  if (site.site_.channel_ != kDefaultChannel) return false;
+  constexpr bool kEncodable = (encodable_arg_v<Args> && ...);
+  std::string_view message;
+  if constexpr (!kEncodable) {
+    // the spec of the statement only applies to the original types
+    auto& formatted = thread_format_buffer();
+    fmt::vformat_to(std::back_inserter(formatted),
+                    fmt::string_view(site.format_.data(), site.format_.size()),
+                    fmt::make_format_args(args...));
+    message = std::string_view(formatted.data(), formatted.size());
+  }
+  auto& buffer = this_thread_binary_buffer();
+  auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+                 std::chrono::system_clock::now().time_since_epoch())
+                 .count();
+  std::unique_lock<std::mutex> lock(buffer.mutex_);
+  if (buffer.data_.size() >= binary_thread_buffer::kMaxPending) {
+    lock.unlock();
+    wait_binary_buffer(buffer);
+    lock.lock();
+  }
+  // stop() turns the flag off before the writer's last pass takes the
+  // buffers under their locks, an entry appended after that pass would be
+  // lost, so it goes through the sinks instead
+  if (!binary_log_active.load(std::memory_order_relaxed)) return false;
+  auto& out = buffer.data_;
+  auto start = out.size();
+  put_raw(out, site.id_);
+  if constexpr (kEncodable) {
+    out.push_back(static_cast<char>(level));
+  } else {
+    out.push_back(static_cast<char>(
+        static_cast<std::uint8_t>(level) |
+        binary_thread_buffer::kFormattedLevel));
+  }
+  put_raw(out, static_cast<std::int64_t>(now));
+  put_raw(out, std::uint32_t{0});
+  try {
+    if constexpr (kEncodable) {
+      encode_args(out, args...);
+    } else {
+      encode_arg(out, message);
+    }
+  } catch (...) {
+    out.resize(start);
+    throw;
+  }
+  auto size = static_cast<std::uint32_t>(
+      out.size() - start - binary_thread_buffer::kEntryHeaderSize);
+  std::memcpy(&out[start + binary_thread_buffer::kLengthOffset], &size,
+              sizeof(size));
+  return true;
+}
+}  // namespace detail
+
+// Writes the CILOG(level, "fmt {}", args...) statements of a program built
+// with CASTIS_CILOG_BINARY defined as binary entries into
+// <target>/<YYYY-MM>/<YYYY-MM-DD>[N]_<app_name>.clog, turned back into the
+// text lines by cilog-decode. Stream style statements, CIMLOG statements of
+// a module other than the default one and statements while no binary logger
+// runs go through the sinks.
+class binary_logger {
+ public:
+  binary_logger(std::string app_name, std::string app_version,
+                std::filesystem::path const& target,
+                RotationPolicy const& rotation);
+  ~binary_logger();
+  binary_logger(binary_logger const&) = delete;
+  binary_logger& operator=(binary_logger const&) = delete;
+
+  // Writes what the threads have logged and stops the writer thread
+  void stop();
+
+ private:
+  void run();
+  void write_out();
+  void write_pending();
+  void open_file();
+  void close_file();
+
+  const std::string app_name_;
+  const std::string app_version_;
+  const std::filesystem::path target_path_;
+  const uintmax_t rotation_size_;
+  detail::rotation_schedule schedule_;
+
+  // entries of the current pass not written to file_ yet
+  std::string pending_;
+  std::vector<bool> defined_sites_;
+  std::filesystem::path file_path_;
+  std::unique_ptr<std::ofstream> file_;
+  uintmax_t file_size_{0};
+  uintmax_t next_index_{0};
+  std::string index_prefix_;
+
+  std::mutex mutex_;
+  bool stopping_{false};
+  std::thread writer_;
+};
+
+// Only one binary logger runs at a time
+std::shared_ptr<binary_logger> init_binary_logger(
+    std::string app_name, std::string app_version,
+    std::string_view target = "./log",
+    RotationPolicy rotation = 10 * 1024 * 1024);
+
+void stop_logger(std::shared_ptr<binary_logger> logger);
+
+// Expands a binary log file into the text lines the sinks would have written,
+// one entry at a time. False if the file is not a binary log or ends in a
+// truncated entry.
+bool decode_binary_log(std::istream& in, std::ostream& out);
+
+}  // namespace logger
+}  // namespace castis
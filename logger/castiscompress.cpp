@@ -0,0 +1,131 @@
+#include "logger/castiscompress.h"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <fstream>
+
+#include "fmt/format.h"
+
+namespace fs = std::filesystem;
+
+namespace castis {
+namespace logger {
+namespace {
+// Lowest CPU and idle I/O priority for the calling thread, so compressing
+// does not compete with the service for the disk
+void lower_thread_priority() {
+  auto tid = static_cast<id_t>(syscall(SYS_gettid));
+  setpriority(PRIO_PROCESS, tid, 19);
+#ifdef SYS_ioprio_set
+  constexpr int kIoprioWhoProcess = 1;
+  constexpr int kIoprioClassIdle = 3;
+  constexpr int kIoprioClassShift = 13;
+  syscall(SYS_ioprio_set, kIoprioWhoProcess, 0,
+          kIoprioClassIdle << kIoprioClassShift);
+#endif
+}
+}  // namespace
+
+log_compressor::log_compressor(std::size_t max_workers, int level)
+    : max_workers_(max_workers ? max_workers : 1), level_(level) {}
+
+log_compressor::~log_compressor() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  for (auto& worker : workers_) worker.join();
+}
+
+void log_compressor::enqueue(std::filesystem::path const& path,
+                             compressed_file_handler on_compressed) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  queue_.emplace_back(path, std::move(on_compressed));
+  // workers are started on demand, up to max_workers_
+  if (idle_workers_ == 0 && workers_.size() < max_workers_) {
+    workers_.emplace_back(&log_compressor::run, this);
+  } else {
+    cond_.notify_one();
+  }
+}
+
+void log_compressor::wait_idle() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_cond_.wait(lock,
+                  [this] { return queue_.empty() && busy_workers_ == 0; });
+}
+
+void log_compressor::run() {
+  lower_thread_priority();
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    ++idle_workers_;
+    cond_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+    --idle_workers_;
+    if (queue_.empty()) return;
+    auto [path, on_compressed] = std::move(queue_.front());
+    queue_.pop_front();
+    ++busy_workers_;
+    lock.unlock();
+    if (compress_file(path, level_) && on_compressed) {
+      auto compressed = path;
+      on_compressed(path, compressed += ".gz");
+    }
+    lock.lock();
+    --busy_workers_;
+    if (queue_.empty() && busy_workers_ == 0) idle_cond_.notify_all();
+  }
+}
+
+bool log_compressor::compress_file(std::filesystem::path const& path,
+                                   int level) {
+  auto target = path;
+  target += ".gz";
+  auto temp = path;
+  temp += ".gz.tmp";
+
+  std::ifstream in(path, std::ios::binary);
+  if (!in.is_open()) return false;
+  gzFile out = gzopen(temp.c_str(), fmt::format("wb{}", level).c_str());
+  if (!out) return false;
+
+  bool ok = true;
+  std::vector<char> buffer(64 * 1024);
+  while (in) {
+    in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    auto size = static_cast<int>(in.gcount());
+    if (size > 0 && gzwrite(out, buffer.data(), size) != size) {
+      ok = false;
+      break;
+    }
+  }
+  if (in.bad()) ok = false;
+  if (gzclose(out) != Z_OK) ok = false;
+
+  // like gzip, the copy keeps the time the file was last written so that
+  // ordering rotated files by time still works after compressing them
+  std::error_code ec;
+  if (ok) {
+    auto time = fs::last_write_time(path, ec);
+    if (!ec) fs::last_write_time(temp, time, ec);
+    fs::rename(temp, target, ec);
+  }
+  if (!ok || ec) {
+    fs::remove(temp, ec);
+    return false;
+  }
+  fs::remove(path, ec);
+  return true;
+}
+
+std::shared_ptr<log_compressor> default_compressor() {
+  static auto compressor = std::make_shared<log_compressor>();
+  return compressor;
+}
+
+}  // namespace logger
+}  // namespace castis
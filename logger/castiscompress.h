@@ -0,0 +1,75 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/smart_ptr/shared_ptr.hpp>
+
+namespace castis {
+namespace logger {
+
+// Called on the compressing thread after original was replaced by compressed
+using compressed_file_handler =
+    std::function<void(std::filesystem::path const& original,
+                       std::filesystem::path const& compressed)>;
+
+// Gzips rotated log files into <file>.gz on low priority background threads
+// and removes the originals. Backends only hand over files they will never
+// write again, so the active file and the <name>.log symlink are not touched.
+class log_compressor {
+ public:
+  explicit log_compressor(std::size_t max_workers = 1, int level = 6);
+  // Compresses the files still queued before returning
+  ~log_compressor();
+  log_compressor(log_compressor const&) = delete;
+  log_compressor& operator=(log_compressor const&) = delete;
+
+  void enqueue(std::filesystem::path const& path,
+               compressed_file_handler on_compressed = {});
+  // Blocks until every queued file has been compressed
+  void wait_idle();
+
+  // Writes path.gz through a temporary file renamed into place and removes
+  // path, the original is kept on any error
+  static bool compress_file(std::filesystem::path const& path, int level);
+
+ private:
+  void run();
+
+  const std::size_t max_workers_;
+  const int level_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::condition_variable idle_cond_;
+  std::deque<std::pair<std::filesystem::path, compressed_file_handler>>
+      queue_;
+  std::vector<std::thread> workers_;
+  std::size_t idle_workers_{0};
+  std::size_t busy_workers_{0};
+  bool stopping_{false};
+};
+
+// One worker shared by the sinks that are not given their own compressor
+std::shared_ptr<log_compressor> default_compressor();
+
+// Compresses the files the sink's backend rotates out
+template <typename SinkT>
+void compress_rotated_files(
+    boost::shared_ptr<SinkT> const& sink,
+    std::shared_ptr<log_compressor> compressor = default_compressor()) {
+  sink->locked_backend()->set_rotated_file_handler(
+      [compressor](std::filesystem::path const& path) {
+        compressor->enqueue(path);
+      });
+}
+
+}  // namespace logger
+}  // namespace castis
@@ -1,6 +1,28 @@
 #include "logger/castislogger.h"
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+
 #include <boost/algorithm/string.hpp>
+#include <boost/log/attributes/value_extraction.hpp>
 #include <boost/log/expressions.hpp>
 #include <boost/log/support/date_time.hpp>
 #include <boost/log/utility/setup/common_attributes.hpp>
@@ -9,48 +31,681 @@
 
 namespace fs = std::filesystem;
 
-// The operator is used when putting the severity level to log
-boost::log::formatting_ostream& operator<<(
-    boost::log::formatting_ostream& strm,
-    boost::log::to_log_manip<severity_level, severity_tag> const& manip) {
+namespace castis {
+namespace logger {
+namespace detail {
+const char* severity_name(severity_level level) {
   static const char* strings[] = {
       "Foo",     "Debug", "Report", "Information", "Success",
       "Warning", "Error", "Fail",   "Exception",   "Critical"};
 
-  severity_level level = manip.get();
   if (static_cast<std::size_t>(level) < sizeof(strings) / sizeof(*strings))
-    strm << strings[level];
+    return strings[level];
+  return nullptr;
+}
+}  // namespace detail
+}  // namespace logger
+}  // namespace castis
+
+// The operator is used when putting the severity level to log
+boost::log::formatting_ostream& operator<<(
+    boost::log::formatting_ostream& strm,
+    boost::log::to_log_manip<severity_level, severity_tag> const& manip) {
+  severity_level level = manip.get();
+  if (auto name = castis::logger::detail::severity_name(level))
+    strm << name;
   else
     strm << static_cast<int>(level);
 
   return strm;
 }
 
+namespace {
+const boost::log::attribute_name kCallSiteAttr("CallSite");
+const boost::log::attribute_name kTidAttr("TID");
+
+// syscall(SYS_gettid) once per thread, reset in the child after fork
+thread_local boost::log::attribute_value t_tid_value;
+void reset_tid_value() { t_tid_value = boost::log::attribute_value(); }
+const int kResetTidAtFork = pthread_atfork(nullptr, nullptr, &reset_tid_value);
+
+boost::log::attribute_value const& tid_value() {
+  if (!t_tid_value) {
+    t_tid_value = boost::log::attributes::make_attribute_value(
+        static_cast<pid_t>(syscall(SYS_gettid)));
+  }
+  return t_tid_value;
+}
+
+// file::func:line:tid,module,
+void format_call_site(boost::log::record_view const& rec,
+                      boost::log::formatting_ostream& strm) {
+  auto site = boost::log::extract<castis::logger::CallSite const*>(
+      kCallSiteAttr, rec);
+  if (!site) return;
+  strm << site.get()->prefix_;
+  auto tid = boost::log::extract<pid_t>(kTidAttr, rec);
+  if (tid) strm << tid.get();
+  strm << site.get()->module_;
+}
+
+const boost::log::attribute_name kFormatArgsAttr("FormatArgs");
+const boost::log::attribute_name kMessageAttr("Message");
+
+const boost::log::attribute_name kTimeStampAttr("TimeStamp");
+const boost::log::attribute_name kSeverityAttr("Severity");
+
+void format_timestamp_attr(boost::log::record_view const& rec,
+                           boost::log::formatting_ostream& strm) {
+  auto timestamp =
+      boost::log::extract<boost::posix_time::ptime>(kTimeStampAttr, rec);
+  if (timestamp) {
+    castis::logger::detail::format_timestamp(timestamp.get(), strm);
+  }
+}
+
+// Lowest level each registered sink accepts and the core filter's level,
+// min_severity_threshold is the maximum of the core level and the lowest
+// sink level
+std::mutex threshold_mutex;
+std::map<void const*, int> sink_thresholds;
+int core_threshold = foo;
+// registered sinks whose formatter renders deferred messages
+std::set<void const*> deferred_format_sinks;
+
+void update_min_severity_threshold() {
+  int lowest = sink_thresholds.empty() ? static_cast<int>(foo) : INT_MAX;
+  bool deferred = !sink_thresholds.empty();
+  for (auto const& threshold : sink_thresholds) {
+    lowest = std::min(lowest, threshold.second);
+    if (!deferred_format_sinks.count(threshold.first)) deferred = false;
+  }
+  castis::logger::detail::min_severity_threshold.store(
+      std::max(lowest, core_threshold), std::memory_order_relaxed);
+  castis::logger::detail::deferred_format_active.store(
+      deferred, std::memory_order_relaxed);
+}
+
+// No level passes an empty level list
+int lowest_level(std::vector<severity_level> const& levels) {
+  int lowest = critical + 1;
+  for (auto level : levels) lowest = std::min(lowest, static_cast<int>(level));
+  return lowest;
+}
+
+int lowest_level(std::vector<castis::logger::Module> const& modules) {
+  int lowest = critical + 1;
+  for (auto const& m : modules) {
+    if (m.level_type_ == castis::logger::Module::min_level) {
+      lowest = std::min(lowest, static_cast<int>(m.min_level_));
+    } else if (!m.specific_levels_.empty()) {
+      lowest =
+          std::min(lowest, static_cast<int>(*m.specific_levels_.begin()));
+    }
+  }
+  return lowest;
+}
+
+// app,version,date,time,severity,file::func:line:tid,module,message
+boost::log::formatter make_cilog_formatter(std::string const& app_name,
+                                           std::string const& app_version) {
+  namespace expr = boost::log::expressions;
+  return expr::stream << app_name << "," << app_version << ","
+                      << expr::wrap_formatter(&format_timestamp_attr) << ","
+                      << expr::attr<severity_level, severity_tag>("Severity")
+                      << "," << expr::wrap_formatter(&format_call_site)
+                      << expr::wrap_formatter(&castis::logger::format_message);
+}
+}  // namespace
+
+namespace castis {
+namespace logger {
+namespace {
+struct channel_registry {
+  // chunk k holds the names of ids [64 * (2^k - 1), 64 * (2^(k+1) - 1))
+  static constexpr unsigned kFirstChunkBits = 6;
+  static constexpr std::size_t kChunks = 33 - kFirstChunkBits;
+
+  std::mutex mutex_;
+  // deque keeps the names in place for the string_view keys
+  std::deque<std::string> names_;
+  std::unordered_map<std::string_view, channel_id> ids_;
+  // Lock-free view of names_ for the sink filters. Chunks are allocated
+  // under the mutex and never moved, a name is visible once size_ covers it.
+  std::array<std::unique_ptr<std::string_view[]>, kChunks> chunks_;
+  std::atomic<std::size_t> size_{0};
+
+  channel_registry() {
+    intern(CASTIS_CILOG_DEFAULT_MODULUE);
+    intern("access");
+    intern("access.unsampled");
+    intern("cilog_stats");
+  }
+
+  static std::pair<std::size_t, std::size_t> position(std::size_t id) {
+    auto pos = id + (std::size_t(1) << kFirstChunkBits);
+    unsigned chunk = 63 - __builtin_clzll(pos) - kFirstChunkBits;
+    return {chunk, pos - (std::size_t(1) << (chunk + kFirstChunkBits))};
+  }
+
+  channel_id intern(std::string_view name) {
+    auto it = ids_.find(name);
+    if (it != ids_.end()) return it->second;
+    auto id = static_cast<channel_id>(names_.size());
+    names_.emplace_back(name);
+    ids_.emplace(names_.back(), id);
+    auto [chunk, offset] = position(id);
+    if (!chunks_[chunk]) {
+      chunks_[chunk] = std::make_unique<std::string_view[]>(
+          std::size_t(1) << (chunk + kFirstChunkBits));
+    }
+    chunks_[chunk][offset] = names_.back();
+    size_.store(names_.size(), std::memory_order_release);
+    return id;
+  }
+
+  std::string_view name(channel_id id) const {
+    if (id >= size_.load(std::memory_order_acquire)) return {};
+    auto [chunk, offset] = position(id);
+    return chunks_[chunk][offset];
+  }
+};
+
+channel_registry& channels() {
+  static channel_registry registry;
+  return registry;
+}
+
+struct format_site_registry {
+  std::mutex mutex_;
+  std::deque<FormatSite const*> sites_;
+};
+
+format_site_registry& format_sites() {
+  static format_site_registry registry;
+  return registry;
+}
+
+std::uint32_t register_format_site(FormatSite const* site) {
+  auto& registry = format_sites();
+  std::lock_guard<std::mutex> lock(registry.mutex_);
+  registry.sites_.push_back(site);
+  return static_cast<std::uint32_t>(registry.sites_.size() - 1);
+}
+}  // namespace
+
+channel_id intern_channel(std::string_view name) {
+  auto& registry = channels();
+  std::lock_guard<std::mutex> lock(registry.mutex_);
+  return registry.intern(name);
+}
+
+std::string_view channel_name(channel_id id) { return channels().name(id); }
+
+CallSite::CallSite(std::string_view file, std::string_view function, int line,
+                   std::string_view module, std::string_view channel)
+    : prefix_(fmt::format("{}::{}:{}:", file, function, line)),
+      module_(fmt::format(",{},", module)),
+      channel_(intern_channel(channel)),
+      value_(boost::log::attributes::make_attribute_value(
+          static_cast<CallSite const*>(this))) {}
+
+FormatSite::FormatSite(CallSite const& site, std::string_view format)
+    : site_(site), format_(format), id_(register_format_site(this)) {}
+
+void format_message(boost::log::record_view const& rec,
+                    boost::log::formatting_ostream& strm) {
+  auto deferred =
+      boost::log::extract<detail::deferred_message>(kFormatArgsAttr, rec);
+  if (deferred) {
+    auto const& args = deferred.get().args_;
+    char const* data = args.data();
+    auto& buffer = detail::thread_format_buffer();
+    detail::format_encoded(buffer, deferred.get().format_, data,
+                           data + args.size());
+    strm.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    return;
+  }
+  auto message = boost::log::extract<std::string>(kMessageAttr, rec);
+  if (message) strm << message.get();
+}
+
+namespace detail {
+FormatSite const* format_site(std::uint32_t id) {
+  auto& registry = format_sites();
+  std::lock_guard<std::mutex> lock(registry.mutex_);
+  return id < registry.sites_.size() ? registry.sites_[id] : nullptr;
+}
+
+boost::log::record open_record(CallSite const& site, severity_level level) {
+  auto rec = ChanelLogger::get().open_record(
+      (boost::log::keywords::channel = site.channel_,
+       boost::log::keywords::severity = level));
+  if (rec) {
+    auto& values = rec.attribute_values();
+    values.insert(kCallSiteAttr, site.value_);
+    values.insert(kTidAttr, tid_value());
+  }
+  return rec;
+}
+
+namespace {
+// The value of a deferred record's "FormatArgs" and "Message" attributes.
+// format_message takes the encoded arguments, a sink that extracts the
+// message as a string (expr::smessage in its own formatter, a sink added to
+// the core directly) gets it formatted once on first use.
+class deferred_message_value final : public boost::log::attribute_value::impl {
+ public:
+  deferred_message_value(std::string_view format, std::string_view args)
+      : message_{format, {args.begin(), args.end()}} {}
+
+  bool dispatch(boost::log::type_dispatcher& dispatcher) override {
+    if (auto callback = dispatcher.get_callback<deferred_message>()) {
+      callback(message_);
+      return true;
+    }
+    if (auto callback = dispatcher.get_callback<std::string>()) {
+      std::call_once(rendered_once_, [this] {
+        auto const& args = message_.args_;
+        char const* data = args.data();
+        auto& buffer = thread_format_buffer();
+        format_encoded(buffer, message_.format_, data, data + args.size());
+        rendered_.assign(buffer.data(), buffer.size());
+      });
+      callback(rendered_);
+      return true;
+    }
+    return false;
+  }
+  boost::typeindex::type_index get_type() const override {
+    return boost::typeindex::type_id<deferred_message>();
+  }
+
+ private:
+  const deferred_message message_;
+  std::once_flag rendered_once_;
+  std::string rendered_;
+};
+}  // namespace
+
+void push_deferred(FormatSite const& site, severity_level level,
+                   std::string_view args) {
+  auto rec = open_record(site.site_, level);
+  if (!rec) return;
+  boost::log::attribute_value value(
+      new deferred_message_value(site.format_, args));
+  rec.attribute_values().insert(kFormatArgsAttr, value);
+  rec.attribute_values().insert(kMessageAttr, value);
+  ChanelLogger::get().push_record(std::move(rec));
+}
+
+void format_timestamp(boost::posix_time::ptime const& timestamp,
+                      boost::log::formatting_ostream& strm) {
+  // "YYYY-MM-DD,HH:MM:SS" is rendered once per second and thread, only the
+  // microseconds are rendered per record
+  struct second_cache {
+    long day_{-1};
+    long second_{-1};
+    char text_[32];
+    std::size_t size_{0};
+  };
+  thread_local second_cache cache;
+
+  if (timestamp.is_special()) {
+    strm << boost::posix_time::to_simple_string(timestamp);
+    return;
+  }
+  auto day = static_cast<long>(timestamp.date().day_number());
+  auto time_of_day = timestamp.time_of_day();
+  auto second = static_cast<long>(time_of_day.total_seconds());
+  if (day != cache.day_ || second != cache.second_) {
+    auto ymd = timestamp.date().year_month_day();
+    auto end = fmt::format_to_n(cache.text_, sizeof(cache.text_),
+                                "{:04}-{:02}-{:02},{:02}:{:02}:{:02}.",
+                                static_cast<int>(ymd.year),
+                                static_cast<int>(ymd.month),
+                                static_cast<int>(ymd.day), second / 3600,
+                                second / 60 % 60, second % 60);
+    cache.size_ = end.size;
+    cache.day_ = day;
+    cache.second_ = second;
+  }
+
+  char fraction_text[16];
+  int digits = boost::posix_time::time_duration::num_fractional_digits();
+  auto fraction = static_cast<long>(time_of_day.fractional_seconds());
+  for (int i = digits - 1; i >= 0; --i) {
+    fraction_text[i] = static_cast<char>('0' + fraction % 10);
+    fraction /= 10;
+  }
+  strm.write(cache.text_, static_cast<std::streamsize>(cache.size_));
+  strm.write(fraction_text, digits);
+}
+
+bool flush_state::written(std::size_t size,
+                          boost::log::record_view const& rec) {
+  bool timed = policy_.interval_.count() > 0;
+  auto now = timed ? std::chrono::steady_clock::now()
+                   : std::chrono::steady_clock::time_point();
+  if (unflushed_bytes_ == 0) first_unflushed_ = now;
+  unflushed_bytes_ += size;
+  if (urgent_) return true;
+  // auto_flush is bytes_ == 1, every line
+  if (policy_.bytes_ > 1 && unflushed_bytes_ >= policy_.bytes_) {
+    urgent_ = true;
+  } else if (policy_.severity_ && rec) {
+    auto level = boost::log::extract<severity_level>(kSeverityAttr, rec);
+    urgent_ = level && level.get() >= *policy_.severity_;
+  }
+  if (!urgent_ && timed) urgent_ = now - first_unflushed_ >= policy_.interval_;
+  due_ = urgent_ || policy_.bytes_ == 1;
+  return due_;
+}
+
+bool flush_state::due() const {
+  if (due_) return true;
+  return unflushed_bytes_ > 0 && policy_.interval_.count() > 0 &&
+         std::chrono::steady_clock::now() - first_unflushed_ >=
+             policy_.interval_;
+}
+
+std::string dropped_records_line(std::string_view app_name,
+                                 std::string_view app_version,
+                                 std::uint64_t dropped) {
+  auto now = std::chrono::system_clock::now();
+  auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                    now.time_since_epoch())
+                    .count() %
+                1000000;
+  return fmt::format("{},{},{:%Y-%m-%d,%H:%M:%S}.{:06},Warning,,,dropped {} "
+                     "records",
+                     app_name, app_version,
+                     fmt::localtime(std::chrono::system_clock::to_time_t(now)),
+                     micros, dropped);
+}
+
+bool duplicate_collapser::repeated(std::string_view line,
+                                   std::chrono::steady_clock::time_point now) {
+  // the message columns start after the fourth comma, the message itself
+  // after the seventh
+  std::size_t body = 0;
+  std::size_t message = 0;
+  for (int column = 0; column < 7; ++column) {
+    auto comma = line.find(',', message);
+    if (comma == std::string_view::npos) break;
+    message = comma + 1;
+    if (column == 3) body = message;
+  }
+  auto hash = std::hash<std::string_view>()(line.substr(body));
+  // the hash rules most lines out, a match is confirmed by the bytes
+  if (has_previous_ && hash == hash_ && line.substr(body) == previous_) {
+    if (repeats_++ == 0) first_repeat_ = now;
+    last_prefix_.assign(line.substr(0, message));
+    return true;
+  }
+  has_previous_ = true;
+  hash_ = hash;
+  previous_.assign(line.substr(body));
+  return false;
+}
+
+bool duplicate_collapser::take_repeats(std::string& out) {
+  if (repeats_ == 0) return false;
+  out.assign(last_prefix_);
+  fmt::format_to(std::back_inserter(out), "last message repeated {} times",
+                 repeats_);
+  repeats_ = 0;
+  return true;
+}
+
+void rotation_schedule::start(std::time_t now) {
+  tm local;
+  boost::date_time::c_time::localtime(&now, &local);
+  auto minutes = static_cast<int>(interval_.count());
+  if (minutes <= 0 || minutes > 24 * 60) minutes = 24 * 60;
+  int start_minute = (local.tm_hour * 60 + local.tm_min) / minutes * minutes;
+
+  // mktime normalizes 24:00 to the next day and picks the DST offset in
+  // effect at the boundary
+  tm start = local;
+  start.tm_hour = start_minute / 60;
+  start.tm_min = start_minute % 60;
+  start.tm_sec = 0;
+  start.tm_isdst = -1;
+  interval_start_ = std::mktime(&start);
+  tm boundary = local;
+  boundary.tm_hour = (start_minute + minutes) / 60;
+  boundary.tm_min = (start_minute + minutes) % 60;
+  boundary.tm_sec = 0;
+  boundary.tm_isdst = -1;
+  boundary_ = std::mktime(&boundary);
+  if (interval_start_ > now) interval_start_ = now;
+  // a boundary skipped or repeated by a DST change
+  if (boundary_ <= now) boundary_ = now + minutes * 60;
+  arm(now);
+}
+
+bool rotation_schedule::check_wall_clock(std::time_t now) {
+  if (now >= boundary_ || now + kBackwardsTolerance < interval_start_) {
+    return true;
+  }
+  arm(now);
+  return false;
+}
+
+void rotation_schedule::arm(std::time_t now) {
+  auto wait = std::min<std::time_t>(boundary_ - now, 60);
+  check_at_ = std::chrono::steady_clock::now() + std::chrono::seconds(wait);
+}
+
+bool batch_file::open(std::filesystem::path const& path,
+                      uintmax_t /*expected_size*/) {
+  close();
+  fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd_ < 0) return false;
+  struct stat st;
+  opened_size_ = (::fstat(fd_, &st) == 0) ? static_cast<uintmax_t>(st.st_size)
+                                          : 0;
+  good_ = true;
+  buffer_.reserve(kBatchSize);
+  return true;
+}
+
+void batch_file::close() {
+  if (fd_ < 0) return;
+  write_pending();
+  ::close(fd_);
+  fd_ = -1;
+}
+
+void batch_file::append(std::string_view line) {
+  if (buffer_.size() + line.size() + 1 > kBatchSize) write_pending();
+  buffer_.append(line.data(), line.size());
+  buffer_.push_back('\n');
+}
+
+void batch_file::write_pending() {
+  const char* data = buffer_.data();
+  std::size_t left = buffer_.size();
+  while (left > 0 && fd_ >= 0) {
+    auto written = ::write(fd_, data, left);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      // the batch is lost as a failed ofstream write lost its line
+      good_ = false;
+      break;
+    }
+    data += written;
+    left -= static_cast<std::size_t>(written);
+  }
+  buffer_.clear();
+}
+
+bool mapped_file::open(std::filesystem::path const& path,
+                       uintmax_t expected_size) {
+  close();
+  fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd_ < 0) return false;
+  struct stat st;
+  if (::fstat(fd_, &st) != 0) {
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  size_ = static_cast<std::size_t>(st.st_size);
+  good_ = true;
+  auto page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+  if (!reserve(std::max({size_, static_cast<std::size_t>(expected_size),
+                         page}))) {
+    close();
+    return false;
+  }
+  // a preallocated file that was not closed ends in NUL bytes
+  while (size_ > 0 && data_[size_ - 1] == '\0') --size_;
+  opened_size_ = size_;
+  synced_ = size_;
+  return true;
+}
+
+void mapped_file::close() {
+  if (fd_ < 0) return;
+  if (data_) {
+    ::munmap(data_, capacity_);
+    data_ = nullptr;
+  }
+  if (::ftruncate(fd_, static_cast<off_t>(size_)) != 0) good_ = false;
+  ::close(fd_);
+  fd_ = -1;
+  capacity_ = size_ = synced_ = 0;
+}
+
+// Allocates the blocks up front so a full disk fails here instead of raising
+// SIGBUS on a store into the mapping. File systems without fallocate get a
+// sparse file.
+bool mapped_file::reserve(std::size_t capacity) {
+  if (capacity <= capacity_) return true;
+  if (::fallocate(fd_, 0, 0, static_cast<off_t>(capacity)) != 0) {
+    if (errno != EOPNOTSUPP ||
+        ::ftruncate(fd_, static_cast<off_t>(capacity)) != 0) {
+      return false;
+    }
+  }
+  void* data = data_ ? ::mremap(data_, capacity_, capacity, MREMAP_MAYMOVE)
+                     : ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, fd_, 0);
+  if (data == MAP_FAILED) return false;
+  data_ = static_cast<char*>(data);
+  capacity_ = capacity;
+  return true;
+}
+
+void mapped_file::append(std::string_view line) {
+  if (!data_ || !good_) return;
+  auto end = size_ + line.size() + 1;
+  if (end > capacity_ && !reserve(std::max(end, capacity_ * 2))) {
+    good_ = false;
+    return;
+  }
+  std::memcpy(data_ + size_, line.data(), line.size());
+  data_[end - 1] = '\n';
+  size_ = end;
+}
+
+void mapped_file::write_pending() {
+  if (!data_ || synced_ >= size_) return;
+  auto page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+  auto begin = synced_ / page * page;
+  ::msync(data_ + begin, size_ - begin, MS_ASYNC);
+  synced_ = size_;
+}
+
+void set_sink_threshold(void const* sink, int level) {
+  std::lock_guard<std::mutex> lock(threshold_mutex);
+  sink_thresholds[sink] = level;
+  update_min_severity_threshold();
+}
+
+void remove_sink_threshold(void const* sink) {
+  std::lock_guard<std::mutex> lock(threshold_mutex);
+  deferred_format_sinks.erase(sink);
+  if (sink_thresholds.erase(sink) > 0) update_min_severity_threshold();
+}
+
+void set_sink_deferred_format(void const* sink) {
+  std::lock_guard<std::mutex> lock(threshold_mutex);
+  deferred_format_sinks.insert(sink);
+  update_min_severity_threshold();
+}
+}  // namespace detail
+
+void set_severity_threshold(severity_level level) {
+  namespace expr = boost::log::expressions;
+  std::lock_guard<std::mutex> lock(threshold_mutex);
+  if (level == foo) {
+    boost::log::core::get()->reset_filter();
+  } else {
+    boost::log::core::get()->set_filter(
+        expr::attr<severity_level>("Severity") >= level);
+  }
+  core_threshold = level;
+  update_min_severity_threshold();
+}
+}  // namespace logger
+}  // namespace castis
+
 cilog_date_hour_backend::cilog_date_hour_backend(
     std::filesystem::path const& target_path, std::string_view file_name_suffix,
-    std::string_view file_name_prefix_format, bool auto_flush)
-    : auto_flush_(auto_flush),
+    std::string_view file_name_prefix_format,
+    castis::logger::FlushPolicy const& flush_policy,
+    std::chrono::minutes rotation_interval /* = std::chrono::hours(1)*/)
+    : flush_state_(flush_policy),
+      schedule_(rotation_interval),
       target_path_(target_path),
       file_name_suffix_(file_name_suffix),
-      file_name_prefix_format_(file_name_prefix_format),
-      current_date_hour_(get_current_date_hour()) {
+      file_name_prefix_format_(file_name_prefix_format) {
   if (boost::starts_with(file_name_prefix_format_, "{:") == false ||
       boost::ends_with(file_name_prefix_format_, "}") == false) {
     file_name_prefix_format_ = "{:" + file_name_prefix_format_ + "}";
   }
 }
 
-void cilog_date_hour_backend::consume(boost::log::record_view const& /*rec*/,
+void cilog_date_hour_backend::consume(boost::log::record_view const& rec,
                                       string_type const& formatted_message) {
-  if (current_date_hour_ != get_current_date_hour()) {
+  if (collapser_.enabled()) {
+    auto now = std::chrono::steady_clock::now();
+    if (collapser_.repeated(formatted_message, now)) {
+      repeat_record_ = rec;
+      if (collapser_.due(now)) write_repeats();
+      return;
+    }
+    write_repeats();
+  }
+  write_line(rec, formatted_message);
+}
+
+void cilog_date_hour_backend::write_notice(std::string_view line) {
+  write_repeats();
+  write_line(boost::log::record_view(), line);
+}
+
+void cilog_date_hour_backend::write_repeats() {
+  if (collapser_.take_repeats(repeat_line_)) {
+    write_line(repeat_record_, repeat_line_);
+  }
+}
+
+void cilog_date_hour_backend::write_line(boost::log::record_view const& rec,
+                                         std::string_view formatted_message) {
+  if (file_.is_open() && schedule_.due(std::chrono::steady_clock::now())) {
     rotate_file();
+    rotated_path_ = file_path_;
   }
 
   if (!file_.is_open()) {
+    schedule_.start();
     file_path_ = generate_filepath();
     fs::create_directories(file_path_.parent_path());
-    file_.open(file_path_, std::ofstream::out | std::ofstream::app);
-    if (!file_.is_open()) {
+    if (!file_.open(file_path_)) {
       // failed to open file
       return;
     }
@@ -62,30 +717,59 @@ void cilog_date_hour_backend::consume(boost::log::record_view const& /*rec*/,
     if (!ec) {
       fs::create_symlink(fs::absolute(file_path_), link_filepath, ec);
     }
+
+    if (!rotated_path_.empty()) {
+      if (rotated_file_handler_ && rotated_path_ != file_path_) {
+        rotated_file_handler_(rotated_path_);
+      }
+      rotated_path_.clear();
+    }
+  }
+  file_.append(formatted_message);
+  if (telemetry_) {
+    castis::logger::detail::sink_telemetry::add(telemetry_->written_, 1);
+    castis::logger::detail::sink_telemetry::add(telemetry_->bytes_,
+                                                formatted_message.size() + 1);
   }
-  file_.write(formatted_message.data(),
-              static_cast<std::streamsize>(formatted_message.size()));
-  file_.put('\n');
 
-  if (auto_flush_) file_.flush();
+  if (flush_state_.written(formatted_message.size() + 1, rec) &&
+      (!batching_ || flush_state_.urgent()))
+    flush();
 
-  if ((file_.is_open() && (current_date_hour_ != get_current_date_hour())) ||
-      (!file_.good())) {
+  if (!file_.good()) {
     rotate_file();
   }
 }
 
+void cilog_date_hour_backend::flush() {
+  write_repeats();
+  castis::logger::detail::telemetry_timer timer(
+      telemetry_.get(), &castis::logger::detail::sink_telemetry::flushes_,
+      &castis::logger::detail::sink_telemetry::flush_ns_);
+  file_.write_pending();
+  flush_state_.flushed();
+}
+
+void cilog_date_hour_backend::flush_if_due() {
+  if (collapser_.due(std::chrono::steady_clock::now())) write_repeats();
+  if (flush_state_.due()) flush();
+}
+
 void cilog_date_hour_backend::rotate_file() {
+  castis::logger::detail::telemetry_timer timer(
+      telemetry_.get(), &castis::logger::detail::sink_telemetry::rotations_,
+      &castis::logger::detail::sink_telemetry::rotation_ns_);
   file_.close();
-  file_.clear();
-  current_date_hour_ = get_current_date_hour();
+  flush_state_.flushed();
 }
 
 std::filesystem::path cilog_date_hour_backend::generate_filepath() {
   if (file_name_prefix_format_.empty())
     file_name_prefix_format_ = "{:%Y-%m-%d[%H]}";
-  auto filename_prefix = datetime_string_with_format(file_name_prefix_format_);
-  auto monthly_path_name = datetime_string_with_format("{:%Y-%m}");
+  auto start = schedule_.interval_start();
+  auto filename_prefix =
+      datetime_string_with_format(file_name_prefix_format_, start);
+  auto monthly_path_name = datetime_string_with_format("{:%Y-%m}", start);
 
   auto monthly_path = target_path_ / monthly_path_name;
 
@@ -95,44 +779,77 @@ std::filesystem::path cilog_date_hour_backend::generate_filepath() {
 }
 
 std::string cilog_date_hour_backend::datetime_string_with_format(
-    std::string_view format) {
-  auto now = std::time(nullptr);
+    std::string_view format, std::time_t time) {
   tm tm;
-  boost::date_time::c_time::localtime(&now, &tm);
+  boost::date_time::c_time::localtime(&time, &tm);
   return fmt::format(format, tm);
 }
 
-std::string cilog_date_hour_backend::get_current_date_hour() {
-  return datetime_string_with_format("{:%Y-%m-%d %H}");
-}
-
 ////////////////////////////////////////////////////////////////////////////////
 
-cilog_backend::cilog_backend(std::filesystem::path const& target_path,
-                             std::string_view file_name_suffix,
-                             uintmax_t rotation_size, bool auto_flush)
-    : auto_flush_(auto_flush),
+template <typename FileT>
+basic_cilog_backend<FileT>::basic_cilog_backend(
+    std::filesystem::path const& target_path, std::string_view file_name_suffix,
+    castis::logger::RotationPolicy const& rotation,
+    castis::logger::FlushPolicy const& flush_policy)
+    : flush_state_(flush_policy),
+      schedule_(rotation.interval_),
+      state_file_(rotation.state_file_),
       target_path_(target_path),
       file_name_suffix_(file_name_suffix),
-      rotation_size_(rotation_size),
-      characters_written_(0),
-      current_date_(boost::gregorian::day_clock::local_day()) {}
+      rotation_size_(rotation.size_),
+      characters_written_(0) {
+  if constexpr (std::is_same_v<FileT, castis::logger::detail::uring_file>) {
+    file_.set_sync(flush_policy.sync_);
+  }
+}
 
-void cilog_backend::consume(boost::log::record_view const& /*rec*/,
-                            string_type const& formatted_message) {
-  if (current_date_ != boost::gregorian::day_clock::local_day()) {
+template <typename FileT>
+void basic_cilog_backend<FileT>::consume(
+    boost::log::record_view const& rec, string_type const& formatted_message) {
+  if (collapser_.enabled()) {
+    auto now = std::chrono::steady_clock::now();
+    if (collapser_.repeated(formatted_message, now)) {
+      repeat_record_ = rec;
+      if (collapser_.due(now)) write_repeats();
+      return;
+    }
+    write_repeats();
+  }
+  write_line(rec, formatted_message);
+}
+
+template <typename FileT>
+void basic_cilog_backend<FileT>::write_notice(std::string_view line) {
+  write_repeats();
+  write_line(boost::log::record_view(), line);
+}
+
+template <typename FileT>
+void basic_cilog_backend<FileT>::write_repeats() {
+  if (collapser_.take_repeats(repeat_line_)) {
+    write_line(repeat_record_, repeat_line_);
+  }
+}
+
+template <typename FileT>
+void basic_cilog_backend<FileT>::write_line(
+    boost::log::record_view const& rec, std::string_view formatted_message) {
+  if (file_.is_open() && schedule_.due(std::chrono::steady_clock::now())) {
     rotate_file();
+    advance_index_ = true;
+    rotated_path_ = file_path_;
   }
 
   if (!file_.is_open()) {
+    schedule_.start();
     file_path_ = generate_filepath();
     fs::create_directories(file_path_.parent_path());
-    file_.open(file_path_, std::ofstream::out | std::ofstream::app);
-    if (!file_.is_open()) {
+    if (!file_.open(file_path_, rotation_size_)) {
       // failed to open file
       return;
     }
-    characters_written_ = static_cast<std::streamoff>(file_.tellp());
+    characters_written_ = file_.opened_size();
 
     auto link_filepath =
         file_path_.parent_path().parent_path() / (file_name_suffix_ + ".log");
@@ -141,56 +858,156 @@ void cilog_backend::consume(boost::log::record_view const& /*rec*/,
     if (!ec) {
       fs::create_symlink(fs::absolute(file_path_), link_filepath, ec);
     }
+
+    if (!rotated_path_.empty()) {
+      if (rotated_file_handler_ && rotated_path_ != file_path_) {
+        rotated_file_handler_(rotated_path_);
+      }
+      rotated_path_.clear();
+    }
+  }
+  file_.append(formatted_message);
+  if (telemetry_) {
+    castis::logger::detail::sink_telemetry::add(telemetry_->written_, 1);
+    castis::logger::detail::sink_telemetry::add(telemetry_->bytes_,
+                                                formatted_message.size() + 1);
   }
-  file_.write(formatted_message.data(),
-              static_cast<std::streamsize>(formatted_message.size()));
-  file_.put('\n');
   characters_written_ += formatted_message.size() + 1;
 
-  if (auto_flush_) file_.flush();
+  if (flush_state_.written(formatted_message.size() + 1, rec) &&
+      (!batching_ || flush_state_.urgent()))
+    flush();
 
-  if ((file_.is_open() && (characters_written_ >= rotation_size_)) ||
-      (!file_.good())) {
+  if (file_.is_open() && (characters_written_ >= rotation_size_)) {
+    rotate_file();
+    advance_index_ = true;
+    rotated_path_ = file_path_;
+  } else if (!file_.good()) {
     rotate_file();
   }
 }
 
-void cilog_backend::rotate_file() {
+template <typename FileT>
+void basic_cilog_backend<FileT>::flush() {
+  write_repeats();
+  castis::logger::detail::telemetry_timer timer(
+      telemetry_.get(), &castis::logger::detail::sink_telemetry::flushes_,
+      &castis::logger::detail::sink_telemetry::flush_ns_);
+  file_.write_pending();
+  flush_state_.flushed();
+}
+
+template <typename FileT>
+void basic_cilog_backend<FileT>::flush_if_due() {
+  if (collapser_.due(std::chrono::steady_clock::now())) write_repeats();
+  if (flush_state_.due()) flush();
+}
+
+template <typename FileT>
+void basic_cilog_backend<FileT>::rotate_file() {
+  castis::logger::detail::telemetry_timer timer(
+      telemetry_.get(), &castis::logger::detail::sink_telemetry::rotations_,
+      &castis::logger::detail::sink_telemetry::rotation_ns_);
   file_.close();
-  file_.clear();
+  flush_state_.flushed();
   characters_written_ = 0;
-  current_date_ = boost::gregorian::day_clock::local_day();
 }
 
-std::filesystem::path cilog_backend::generate_filepath() {
-  auto filename_prefix = datetime_string_with_format("{:%Y-%m-%d}");
-  auto monthly_path_name = datetime_string_with_format("{:%Y-%m}");
+template <typename FileT>
+std::filesystem::path basic_cilog_backend<FileT>::generate_filepath() {
+  auto start = schedule_.interval_start();
+  auto filename_prefix = datetime_string_with_format("{:%Y-%m-%d}", start);
+  auto monthly_path_name = datetime_string_with_format("{:%Y-%m}", start);
 
   auto monthly_path = target_path_ / monthly_path_name;
-  // e.g. 2014-08-12[1]_example.log
-  std::regex pattern(filename_prefix + "(\\[[0-9]+\\])?" + "_" +
-                     file_name_suffix_ + ".log");
-  auto next_index = scan_next_index(monthly_path, pattern);
 
-  auto filename =
-      (next_index > 0)
-          ? fmt::format("{}[{}]_{}.log", filename_prefix, next_index,
-                        file_name_suffix_)
-          : fmt::format("{}_{}.log", filename_prefix, file_name_suffix_);
+  // The month directory is only scanned when neither memory nor the state
+  // file knows the index, or a new date already has files
+  uintmax_t next_index = 0;
+  if (index_known_ && filename_prefix == index_prefix_) {
+    next_index = current_index_ + (advance_index_ ? 1 : 0);
+  } else if (index_known_ &&
+             !fs::exists(indexed_filepath(monthly_path, filename_prefix, 0)) &&
+             !fs::exists(
+                 indexed_filepath(monthly_path, filename_prefix, 0) += ".gz")) {
+    next_index = 0;
+  } else if (index_known_ ||
+             !read_state(monthly_path, filename_prefix, next_index)) {
+    // e.g. 2014-08-12[1]_example.log, 2014-08-12[1]_example.log.gz
+    std::regex pattern(filename_prefix + "(\\[[0-9]+\\])?" + "_" +
+                       file_name_suffix_ + ".log(\\.gz)?");
+    castis::logger::detail::telemetry_timer timer(
+        telemetry_.get(), &castis::logger::detail::sink_telemetry::index_scans_,
+        &castis::logger::detail::sink_telemetry::index_scan_ns_);
+    next_index = scan_next_index(monthly_path, pattern);
+  }
+  index_known_ = true;
+  index_prefix_ = filename_prefix;
+  current_index_ = next_index;
+  advance_index_ = false;
+  if (state_file_) write_state();
+
+  return indexed_filepath(monthly_path, filename_prefix, next_index);
+}
 
+template <typename FileT>
+std::filesystem::path basic_cilog_backend<FileT>::indexed_filepath(
+    std::filesystem::path const& monthly_path, std::string const& prefix,
+    uintmax_t index) const {
+  auto filename =
+      (index > 0)
+          ? fmt::format("{}[{}]_{}.log", prefix, index, file_name_suffix_)
+          : fmt::format("{}_{}.log", prefix, file_name_suffix_);
   return monthly_path / filename;
 }
 
-std::string cilog_backend::datetime_string_with_format(
-    std::string_view format) {
-  auto now = std::time(nullptr);
+template <typename FileT>
+std::filesystem::path basic_cilog_backend<FileT>::state_filepath() const {
+  return target_path_ / fmt::format(".{}.index", file_name_suffix_);
+}
+
+// "2014-08-12 3", trusted only while that file exists and is the last one
+template <typename FileT>
+bool basic_cilog_backend<FileT>::read_state(
+    std::filesystem::path const& monthly_path, std::string const& prefix,
+    uintmax_t& next_index) {
+  if (!state_file_) return false;
+  std::ifstream state(state_filepath());
+  std::string state_prefix;
+  uintmax_t state_index = 0;
+  if (!(state >> state_prefix >> state_index) || state_prefix != prefix) {
+    return false;
+  }
+  std::error_code ec;
+  auto filesize =
+      fs::file_size(indexed_filepath(monthly_path, prefix, state_index), ec);
+  if (ec ||
+      fs::exists(indexed_filepath(monthly_path, prefix, state_index + 1))) {
+    return false;
+  }
+  next_index = (filesize >= rotation_size_) ? state_index + 1 : state_index;
+  return true;
+}
+
+template <typename FileT>
+void basic_cilog_backend<FileT>::write_state() {
+  std::error_code ec;
+  fs::create_directories(target_path_, ec);
+  std::ofstream state(state_filepath(), std::ofstream::trunc);
+  state << index_prefix_ << ' ' << current_index_ << '\n';
+}
+
+template <typename FileT>
+std::string basic_cilog_backend<FileT>::datetime_string_with_format(
+    std::string_view format, std::time_t time) {
   tm tm;
-  boost::date_time::c_time::localtime(&now, &tm);
+  boost::date_time::c_time::localtime(&time, &tm);
   return fmt::format(format, tm);
 }
 
-uintmax_t cilog_backend::scan_next_index(std::filesystem::path const& path,
-                                         std::regex const& pattern) {
+template <typename FileT>
+uintmax_t basic_cilog_backend<FileT>::scan_next_index(
+    std::filesystem::path const& path, std::regex const& pattern) {
   uintmax_t current_index = 0;
   fs::path current_fs;
   if (fs::exists(path) && fs::is_directory(path)) {
@@ -209,14 +1026,18 @@ uintmax_t cilog_backend::scan_next_index(std::filesystem::path const& path,
   std::error_code ec;
   auto filesize = fs::file_size(current_fs, ec);
   if (!ec) {
-    if (filesize >= rotation_size_) {
+    // an interval shorter than a day starts a new file of the same date, and
+    // a compressed file is never appended to
+    if (filesize >= rotation_size_ || advance_index_ ||
+        current_fs.extension() == ".gz") {
       ++current_index;
     }
   }
   return current_index;
 }
 
-uintmax_t cilog_backend::parse_index(std::string const& filename) {
+template <typename FileT>
+uintmax_t basic_cilog_backend<FileT>::parse_index(std::string const& filename) {
   auto pos_index_begin = filename.find('[');
   auto pos_index_end = filename.find(']');
   unsigned int index = 0;
@@ -229,67 +1050,126 @@ uintmax_t cilog_backend::parse_index(std::string const& filename) {
   return index;
 }
 
+template class basic_cilog_backend<castis::logger::detail::batch_file>;
+template class basic_cilog_backend<castis::logger::detail::mapped_file>;
+template class basic_cilog_backend<castis::logger::detail::uring_file>;
+
 ////////////////////////////////////////////////////////////////////////////////
 
 namespace castis {
 namespace logger {
 void init_logger(std::string app_name, std::string app_version,
                  std::string_view target /* = "./log"*/,
-                 int64_t rotation_size /* = 10 * 1024 * 1024*/,
-                 bool auto_flush /* = true*/) {
+                 RotationPolicy rotation /* = 10 * 1024 * 1024*/,
+                 FlushPolicy flush_policy /* = true*/) {
   namespace expr = boost::log::expressions;
   boost::log::add_common_attributes();
   auto backend = boost::make_shared<cilog_backend>(fs::path(target), app_name,
-                                                   rotation_size, auto_flush);
+                                                   rotation, flush_policy);
 
   auto sink = boost::make_shared<cilog_sync_sink_t>(backend);
-  sink->set_formatter(expr::stream
-                      << app_name << "," << app_version << ","
-                      << expr::format_date_time<boost::posix_time::ptime>(
-                             "TimeStamp", "%Y-%m-%d,%H:%M:%S.%f")
-                      << ","
-                      << expr::attr<severity_level, severity_tag>("Severity")
-                      << "," << expr::smessage);
+  sink->set_formatter(make_cilog_formatter(app_name, app_version));
 
-  sink->set_filter(expr::attr<std::string>("Channel") ==
-                   CASTIS_CILOG_DEFAULT_MODULUE);
+  sink->set_filter(expr::attr<channel_id>("Channel") == kDefaultChannel);
 
+  detail::set_sink_threshold(sink.get(), foo);
   boost::log::core::get()->add_sink(sink);
 }
 
 boost::shared_ptr<cilog_async_sink_t> init_async_logger(
     std::string app_name, std::string app_version,
     std::string_view target /* = "./log"*/,
-    int64_t rotation_size /* = 10 * 1024 * 1024*/,
-    bool auto_flush /* = true*/) {
+    RotationPolicy rotation /* = 10 * 1024 * 1024*/,
+    FlushPolicy flush_policy /* = true*/, QueueOptions queue /* = {}*/) {
   namespace expr = boost::log::expressions;
   boost::log::add_common_attributes();
   auto backend = boost::make_shared<cilog_backend>(fs::path(target), app_name,
-                                                   rotation_size, auto_flush);
-
-  auto sink = boost::make_shared<cilog_async_sink_t>(backend);
-  sink->set_formatter(expr::stream
-                      << app_name << "," << app_version << ","
-                      << expr::format_date_time<boost::posix_time::ptime>(
-                             "TimeStamp", "%Y-%m-%d,%H:%M:%S.%f")
-                      << ","
-                      << expr::attr<severity_level, severity_tag>("Severity")
-                      << "," << expr::smessage);
+                                                   rotation, flush_policy);
+
+  auto sink = boost::make_shared<cilog_async_sink_t>(
+      backend, keywords::queue_options = queue);
+  detail::set_idle_flush(sink.get(), flush_policy);
+  detail::set_drop_notice(sink.get(), app_name, app_version);
+  sink->set_formatter(make_cilog_formatter(app_name, app_version));
+
+  detail::set_telemetry_filter(
+      sink.get(), expr::attr<channel_id>("Channel") == kDefaultChannel);
+
+  if (queue.deferred_format_) detail::set_sink_deferred_format(sink.get());
+  detail::set_sink_threshold(sink.get(), foo);
+  boost::log::core::get()->add_sink(sink);
+
+  return sink;
+}
+
+boost::shared_ptr<cilog_mmap_async_sink_t> init_async_mmap_logger(
+    std::string app_name, std::string app_version,
+    std::string_view target /* = "./log"*/,
+    RotationPolicy rotation /* = 10 * 1024 * 1024*/,
+    FlushPolicy flush_policy /* = true*/, QueueOptions queue /* = {}*/) {
+  namespace expr = boost::log::expressions;
+  boost::log::add_common_attributes();
+  auto backend = boost::make_shared<cilog_mmap_backend>(
+      fs::path(target), app_name, rotation, flush_policy);
 
-  sink->set_filter(expr::attr<std::string>("Channel") ==
-                   CASTIS_CILOG_DEFAULT_MODULUE);
+  auto sink = boost::make_shared<cilog_mmap_async_sink_t>(
+      backend, keywords::queue_options = queue);
+  detail::set_idle_flush(sink.get(), flush_policy);
+  detail::set_drop_notice(sink.get(), app_name, app_version);
+  sink->set_formatter(make_cilog_formatter(app_name, app_version));
 
+  detail::set_telemetry_filter(
+      sink.get(), expr::attr<channel_id>("Channel") == kDefaultChannel);
+
+  if (queue.deferred_format_) detail::set_sink_deferred_format(sink.get());
+  detail::set_sink_threshold(sink.get(), foo);
   boost::log::core::get()->add_sink(sink);
 
   return sink;
 }
 
+boost::shared_ptr<cilog_uring_async_sink_t> init_async_uring_logger(
+    std::string app_name, std::string app_version,
+    std::string_view target /* = "./log"*/,
+    RotationPolicy rotation /* = 10 * 1024 * 1024*/,
+    FlushPolicy flush_policy /* = true*/, QueueOptions queue /* = {}*/) {
+  namespace expr = boost::log::expressions;
+  boost::log::add_common_attributes();
+  auto backend = boost::make_shared<cilog_uring_backend>(
+      fs::path(target), app_name, rotation, flush_policy);
+
+  auto sink = boost::make_shared<cilog_uring_async_sink_t>(
+      backend, keywords::queue_options = queue);
+  detail::set_idle_flush(sink.get(), flush_policy);
+  detail::set_drop_notice(sink.get(), app_name, app_version);
+  sink->set_formatter(make_cilog_formatter(app_name, app_version));
+
+  detail::set_telemetry_filter(
+      sink.get(), expr::attr<channel_id>("Channel") == kDefaultChannel);
+
+  if (queue.deferred_format_) detail::set_sink_deferred_format(sink.get());
+  detail::set_sink_threshold(sink.get(), foo);
+  boost::log::core::get()->add_sink(sink);
+
+  return sink;
+}
+
+namespace {
+// Channels the unnamed modules do not take, only a module of their name
+bool reserved_channel(channel_id id) {
+  return id == kAccessChannel || id == kAccessUnsampledChannel ||
+         id == kStatsChannel;
+}
+}  // namespace
+
 bool func_module_severity_filter(
-    boost::log::value_ref<std::string> const& ch,
+    boost::log::value_ref<channel_id> const& ch,
     boost::log::value_ref<severity_level> const& level,
     const std::vector<Module>& modules) {
+  if (!ch) return false;
+  auto name = channel_name(ch.get());
   for (const auto& m : modules) {
-    if (m.name_ == ch || (m.name_.empty() && ch != "access")) {
+    if (m.name_ == name || (m.name_.empty() && !reserved_channel(ch.get()))) {
       if (m.level_type_ == Module::min_level) {
         return level >= m.min_level_;
       } else {
@@ -300,32 +1180,94 @@ bool func_module_severity_filter(
   return false;
 }
 
+namespace {
+std::uint16_t level_mask(Module const& m) {
+  std::uint16_t mask = 0;
+  for (int level = foo; level <= critical; ++level) {
+    bool accepted =
+        (m.level_type_ == Module::min_level)
+            ? level >= m.min_level_
+            : m.specific_levels_.count(static_cast<severity_level>(level)) > 0;
+    if (accepted) mask |= static_cast<std::uint16_t>(1u << level);
+  }
+  return mask;
+}
+
+// The mask of the module func_module_severity_filter would pick for channel
+std::uint16_t first_match_mask(std::vector<Module> const& modules,
+                               channel_id channel) {
+  auto name = channel_name(channel);
+  for (const auto& m : modules) {
+    if (m.name_ == name || (m.name_.empty() && !reserved_channel(channel))) {
+      return level_mask(m);
+    }
+  }
+  return 0;
+}
+}  // namespace
+
+module_filter_table::module_filter_table(std::vector<Module> const& modules) {
+  for (const auto& m : modules) {
+    if (m.name_.empty()) {
+      other_mask_ = level_mask(m);
+      break;
+    }
+  }
+  // the reserved channels never fall back to the unnamed modules, so they
+  // always have an entry
+  masks_.assign(kStatsChannel + 1, other_mask_);
+  for (channel_id id = 0; id <= kStatsChannel; ++id) {
+    masks_[id] = first_match_mask(modules, id);
+  }
+  for (const auto& m : modules) {
+    if (m.name_.empty()) continue;
+    auto id = intern_channel(m.name_);
+    if (id >= masks_.size()) masks_.resize(id + 1, other_mask_);
+    masks_[id] = first_match_mask(modules, id);
+  }
+}
+
+bool module_filter_table::accepts(channel_id channel,
+                                  severity_level level) const {
+  if (static_cast<unsigned>(level) > critical) return false;
+  auto mask = channel < masks_.size() ? masks_[channel] : other_mask_;
+  return (mask >> level) & 1u;
+}
+
+bool func_module_table_filter(
+    boost::log::value_ref<channel_id> const& ch,
+    boost::log::value_ref<severity_level> const& level,
+    module_filter_table const& table) {
+  return ch && level && table.accepts(ch.get(), level.get());
+}
+
 boost::shared_ptr<cilog_async_sink_t> init_async_module_logger(
     std::string app_name, std::string app_version,
     const std::vector<Module>& filters, std::string_view file_name_suffix,
     std::string_view target /* = "./log"*/,
-    int64_t rotation_size /* = 10 * 1024 * 1024*/,
-    bool auto_flush /* = true*/) {
+    RotationPolicy rotation /* = 10 * 1024 * 1024*/,
+    FlushPolicy flush_policy /* = true*/, QueueOptions queue /* = {}*/) {
   namespace expr = boost::log::expressions;
   boost::log::add_common_attributes();
 
   std::vector<boost::shared_ptr<cilog_async_sink_t>> sinks;
   auto backend = boost::make_shared<cilog_backend>(
-      fs::path(target), file_name_suffix, rotation_size, auto_flush);
-
-  auto sink = boost::make_shared<cilog_async_sink_t>(backend);
-  sink->set_formatter(expr::stream
-                      << app_name << "," << app_version << ","
-                      << expr::format_date_time<boost::posix_time::ptime>(
-                             "TimeStamp", "%Y-%m-%d,%H:%M:%S.%f")
-                      << ","
-                      << expr::attr<severity_level, severity_tag>("Severity")
-                      << "," << expr::smessage);
-
-  sink->set_filter(boost::phoenix::bind(
-      &func_module_severity_filter, expr::attr<std::string>("Channel"),
-      expr::attr<severity_level>("Severity"), filters));
-
+      fs::path(target), file_name_suffix, rotation, flush_policy);
+
+  auto sink = boost::make_shared<cilog_async_sink_t>(
+      backend, keywords::queue_options = queue);
+  detail::set_idle_flush(sink.get(), flush_policy);
+  detail::set_drop_notice(sink.get(), app_name, app_version);
+  sink->set_formatter(make_cilog_formatter(app_name, app_version));
+
+  detail::set_telemetry_filter(
+      sink.get(), boost::phoenix::bind(&func_module_table_filter,
+                                       expr::attr<channel_id>("Channel"),
+                                       expr::attr<severity_level>("Severity"),
+                                       module_filter_table(filters)));
+
+  if (queue.deferred_format_) detail::set_sink_deferred_format(sink.get());
+  detail::set_sink_threshold(sink.get(), lowest_level(filters));
   boost::log::core::get()->add_sink(sink);
   sinks.push_back(sink);
 
@@ -333,11 +1275,14 @@ boost::shared_ptr<cilog_async_sink_t> init_async_module_logger(
 }
 
 bool func_module_ptr_severity_filter(
-    boost::log::value_ref<std::string> const& ch,
+    boost::log::value_ref<channel_id> const& ch,
     boost::log::value_ref<severity_level> const& level,
     const std::vector<std::shared_ptr<Module>>& modules) {
+  if (!ch) return false;
+  auto name = channel_name(ch.get());
   for (const auto& m : modules) {
-    if (m->name_ == ch || (m->name_.empty() && ch != "access")) {
+    if (m->name_ == name ||
+        (m->name_.empty() && !reserved_channel(ch.get()))) {
       if (m->level_type_ == Module::min_level) {
         return level >= m->min_level_;
       } else {
@@ -353,28 +1298,30 @@ boost::shared_ptr<cilog_async_sink_t> init_async_module_logger(
     std::string app_name, std::string app_version,
     const std::vector<std::shared_ptr<Module>>& filters,
     std::string_view file_name_suffix, std::string_view target /* = "./log"*/,
-    int64_t rotation_size /* = 10 * 1024 * 1024*/,
-    bool auto_flush /* = true*/) {
+    RotationPolicy rotation /* = 10 * 1024 * 1024*/,
+    FlushPolicy flush_policy /* = true*/, QueueOptions queue /* = {}*/) {
   namespace expr = boost::log::expressions;
   boost::log::add_common_attributes();
 
   std::vector<boost::shared_ptr<cilog_async_sink_t>> sinks;
   auto backend = boost::make_shared<cilog_backend>(
-      fs::path(target), file_name_suffix, rotation_size, auto_flush);
-
-  auto sink = boost::make_shared<cilog_async_sink_t>(backend);
-  sink->set_formatter(expr::stream
-                      << app_name << "," << app_version << ","
-                      << expr::format_date_time<boost::posix_time::ptime>(
-                             "TimeStamp", "%Y-%m-%d,%H:%M:%S.%f")
-                      << ","
-                      << expr::attr<severity_level, severity_tag>("Severity")
-                      << "," << expr::smessage);
-
-  sink->set_filter(boost::phoenix::bind(
-      &func_module_ptr_severity_filter, expr::attr<std::string>("Channel"),
-      expr::attr<severity_level>("Severity"), filters));
-
+      fs::path(target), file_name_suffix, rotation, flush_policy);
+
+  auto sink = boost::make_shared<cilog_async_sink_t>(
+      backend, keywords::queue_options = queue);
+  detail::set_idle_flush(sink.get(), flush_policy);
+  detail::set_drop_notice(sink.get(), app_name, app_version);
+  sink->set_formatter(make_cilog_formatter(app_name, app_version));
+
+  detail::set_telemetry_filter(
+      sink.get(), boost::phoenix::bind(&func_module_ptr_severity_filter,
+                                       expr::attr<channel_id>("Channel"),
+                                       expr::attr<severity_level>("Severity"),
+                                       filters));
+
+  // the modules can be changed through the pointers at any time
+  if (queue.deferred_format_) detail::set_sink_deferred_format(sink.get());
+  detail::set_sink_threshold(sink.get(), foo);
   boost::log::core::get()->add_sink(sink);
   sinks.push_back(sink);
 
@@ -385,24 +1332,23 @@ boost::shared_ptr<cilog_date_hour_async_sink_t> init_async_date_hour_logger(
     std::string app_name, std::string app_version,
     std::string_view target /* = "./log"*/,
     std::string_view file_name_prefix_format /* = "%Y-%m-%d[%H]"*/,
-    bool auto_flush /* = true*/) {
+    FlushPolicy flush_policy /* = true*/, QueueOptions queue /* = {}*/) {
   namespace expr = boost::log::expressions;
   boost::log::add_common_attributes();
   auto backend = boost::make_shared<cilog_date_hour_backend>(
-      fs::path(target), app_name, file_name_prefix_format, auto_flush);
-
-  auto sink = boost::make_shared<cilog_date_hour_async_sink_t>(backend);
-  sink->set_formatter(expr::stream
-                      << app_name << "," << app_version << ","
-                      << expr::format_date_time<boost::posix_time::ptime>(
-                             "TimeStamp", "%Y-%m-%d,%H:%M:%S.%f")
-                      << ","
-                      << expr::attr<severity_level, severity_tag>("Severity")
-                      << "," << expr::smessage);
+      fs::path(target), app_name, file_name_prefix_format, flush_policy);
+
+  auto sink = boost::make_shared<cilog_date_hour_async_sink_t>(
+      backend, keywords::queue_options = queue);
+  detail::set_idle_flush(sink.get(), flush_policy);
+  detail::set_drop_notice(sink.get(), app_name, app_version);
+  sink->set_formatter(make_cilog_formatter(app_name, app_version));
 
-  sink->set_filter(expr::attr<std::string>("Channel") ==
-                   CASTIS_CILOG_DEFAULT_MODULUE);
+  detail::set_telemetry_filter(
+      sink.get(), expr::attr<channel_id>("Channel") == kDefaultChannel);
 
+  if (queue.deferred_format_) detail::set_sink_deferred_format(sink.get());
+  detail::set_sink_threshold(sink.get(), foo);
   boost::log::core::get()->add_sink(sink);
 
   return sink;
@@ -422,28 +1368,28 @@ boost::shared_ptr<cilog_async_sink_t> init_async_level_logger(
     std::string app_name, std::string app_version,
     const std::vector<severity_level> severity_levels,
     std::string_view file_name_suffix, std::string_view target /* = "./log"*/,
-    int64_t rotation_size /* = 10 * 1024 * 1024*/,
-    bool auto_flush /* = true*/) {
+    RotationPolicy rotation /* = 10 * 1024 * 1024*/,
+    FlushPolicy flush_policy /* = true*/, QueueOptions queue /* = {}*/) {
   namespace expr = boost::log::expressions;
   boost::log::add_common_attributes();
   auto backend = boost::make_shared<cilog_backend>(
-      fs::path(target), file_name_suffix, rotation_size, auto_flush);
-
-  auto sink = boost::make_shared<cilog_async_sink_t>(backend);
-  sink->set_formatter(expr::stream
-                      << app_name << "," << app_version << ","
-                      << expr::format_date_time<boost::posix_time::ptime>(
-                             "TimeStamp", "%Y-%m-%d,%H:%M:%S.%f")
-                      << ","
-                      << expr::attr<severity_level, severity_tag>("Severity")
-                      << "," << expr::smessage);
-
-  sink->set_filter(expr::attr<std::string>("Channel") ==
-                       CASTIS_CILOG_DEFAULT_MODULUE &&
-                   boost::phoenix::bind(&func_severity_filter,
-                                        expr::attr<severity_level>("Severity"),
-                                        severity_levels));
-
+      fs::path(target), file_name_suffix, rotation, flush_policy);
+
+  auto sink = boost::make_shared<cilog_async_sink_t>(
+      backend, keywords::queue_options = queue);
+  detail::set_idle_flush(sink.get(), flush_policy);
+  detail::set_drop_notice(sink.get(), app_name, app_version);
+  sink->set_formatter(make_cilog_formatter(app_name, app_version));
+
+  detail::set_telemetry_filter(
+      sink.get(), expr::attr<channel_id>("Channel") == kDefaultChannel &&
+                      boost::phoenix::bind(
+                          &func_severity_filter,
+                          expr::attr<severity_level>("Severity"),
+                          severity_levels));
+
+  if (queue.deferred_format_) detail::set_sink_deferred_format(sink.get());
+  detail::set_sink_threshold(sink.get(), lowest_level(severity_levels));
   boost::log::core::get()->add_sink(sink);
 
   return sink;
@@ -455,27 +1401,27 @@ init_async_date_hour_level_logger(
     const std::vector<severity_level> severity_levels,
     std::string_view file_name_suffix, std::string_view target /* = "./log"*/,
     std::string_view file_name_prefix_format /* = "%Y-%m-%d[%H]"*/,
-    bool auto_flush /* = true*/) {
+    FlushPolicy flush_policy /* = true*/, QueueOptions queue /* = {}*/) {
   namespace expr = boost::log::expressions;
   boost::log::add_common_attributes();
   auto backend = boost::make_shared<cilog_date_hour_backend>(
-      fs::path(target), file_name_suffix, file_name_prefix_format, auto_flush);
-
-  auto sink = boost::make_shared<cilog_date_hour_async_sink_t>(backend);
-  sink->set_formatter(expr::stream
-                      << app_name << "," << app_version << ","
-                      << expr::format_date_time<boost::posix_time::ptime>(
-                             "TimeStamp", "%Y-%m-%d,%H:%M:%S.%f")
-                      << ","
-                      << expr::attr<severity_level, severity_tag>("Severity")
-                      << "," << expr::smessage);
-
-  sink->set_filter(expr::attr<std::string>("Channel") ==
-                       CASTIS_CILOG_DEFAULT_MODULUE &&
-                   boost::phoenix::bind(&func_severity_filter,
-                                        expr::attr<severity_level>("Severity"),
-                                        severity_levels));
-
+      fs::path(target), file_name_suffix, file_name_prefix_format, flush_policy);
+
+  auto sink = boost::make_shared<cilog_date_hour_async_sink_t>(
+      backend, keywords::queue_options = queue);
+  detail::set_idle_flush(sink.get(), flush_policy);
+  detail::set_drop_notice(sink.get(), app_name, app_version);
+  sink->set_formatter(make_cilog_formatter(app_name, app_version));
+
+  detail::set_telemetry_filter(
+      sink.get(), expr::attr<channel_id>("Channel") == kDefaultChannel &&
+                      boost::phoenix::bind(
+                          &func_severity_filter,
+                          expr::attr<severity_level>("Severity"),
+                          severity_levels));
+
+  if (queue.deferred_format_) detail::set_sink_deferred_format(sink.get());
+  detail::set_sink_threshold(sink.get(), lowest_level(severity_levels));
   boost::log::core::get()->add_sink(sink);
 
   return sink;
@@ -1,17 +1,25 @@
 #pragma once
 
-#include <sys/syscall.h>
-
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <ctime>
 #include <filesystem>
-#include <fstream>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <regex>
 #include <set>
 #include <string>
 #include <string_view>
+#include <tuple>
 #include <vector>
 
+#include <boost/container/small_vector.hpp>
+#include <boost/log/attributes/attribute_value.hpp>
+#include <boost/log/expressions/filter.hpp>
 #include <boost/log/sinks/async_frontend.hpp>
 #include <boost/log/sources/global_logger_storage.hpp>
 #include <boost/log/sources/record_ostream.hpp>
@@ -21,6 +29,9 @@
 // https://github.com/fmtlib/fmt
 #include "fmt/format.h"
 
+#include "castisargs.h"
+#include "castisqueue.h"
+
 constexpr const char* cilogger_str_end(const char* str) {
   return *str ? cilogger_str_end(str + 1) : str;
 }
@@ -37,39 +48,151 @@ constexpr const char* cilogger_file_name(const char* str) {
 
 #define CASTIS_CILOG_DEFAULT_MODULUE "default"
 
+// The call site descriptor is built once per macro expansion. __FUNCTION__
+// is passed in because inside the lambda it would name the lambda itself.
+// The channel name is interned into its id there as well.
+#define CASTIS_CILOG_CALL_SITE(chan, module_text)                          \
+  [](const char* function) -> ::castis::logger::CallSite const& {          \
+    static const ::castis::logger::CallSite site(                          \
+        cilogger_file_name(__FILE__), function, __LINE__, module_text,     \
+        chan);                                                             \
+    return site;                                                           \
+  }(__FUNCTION__)
+
+#define CASTIS_CILOG_RECORD(chan, module_text, lvl) \
+  CASTIS_CILOG_SITE_RECORD(CASTIS_CILOG_CALL_SITE(chan, module_text), lvl)
+
+#define CASTIS_CILOG_SITE_RECORD(call_site, lvl)                           \
+  for (::boost::log::record _cilog_record_ =                               \
+           ::castis::logger::detail::open_record((call_site), (lvl));      \
+       !!_cilog_record_;)                                                  \
+  ::boost::log::aux::make_record_pump(ChanelLogger::get(), _cilog_record_) \
+      .stream()
+
+// A statement below the lowest level any sink accepts costs one relaxed load
+#define CASTIS_CILOG_STREAM(chan, module_text, lvl)           \
+  if (!::castis::logger::detail::severity_enabled(lvl)) {     \
+  } else                                                      \
+    CASTIS_CILOG_RECORD(chan, module_text, lvl)
+
+// The format site of a statement with a format string, see FormatSite
+#define CASTIS_CILOG_FORMAT_SITE(chan, module_text, fmt_str)           \
+  [](const char* function) -> ::castis::logger::FormatSite const& {    \
+    static const ::castis::logger::CallSite site(                      \
+        cilogger_file_name(__FILE__), function, __LINE__, module_text, \
+        chan);                                                         \
+    static const ::castis::logger::FormatSite format_site(site,        \
+                                                          fmt_str);    \
+    return format_site;                                                \
+  }(__FUNCTION__)
+
+// Built with CASTIS_CILOG_BINARY, a statement with a format string is written
+// as a binary entry while a binary_logger runs (see castisbinlog.h)
+#ifdef CASTIS_CILOG_BINARY
+#define CASTIS_CILOG_BINARY_LOG(format_site, lvl, ...) \
+  ::castis::logger::detail::binary_log(format_site, lvl, ##__VA_ARGS__)
+#else
+#define CASTIS_CILOG_BINARY_LOG(format_site, lvl, ...) false
+#endif
+
+// The arguments are formatted by the caller unless the binary logger or a
+// sink formatting deferred messages takes them
+#define CASTIS_CILOG_FORMAT(chan, module_text, lvl, fmt_str, ...)          \
+  if (!::castis::logger::detail::severity_enabled(lvl)) {                  \
+  } else if (auto const& _cilog_site_ =                                    \
+                 CASTIS_CILOG_FORMAT_SITE(chan, module_text, fmt_str);     \
+             CASTIS_CILOG_BINARY_LOG(_cilog_site_, (lvl), ##__VA_ARGS__) || \
+             ::castis::logger::detail::log_deferred(_cilog_site_, (lvl),   \
+                                                    ##__VA_ARGS__)) {      \
+  } else                                                                   \
+    CASTIS_CILOG_SITE_RECORD(_cilog_site_.site_, lvl)                      \
+        << ::castis::logger::detail::formatted(FMT_STRING(fmt_str),        \
+                                               ##__VA_ARGS__)
+
 #define CIMLOG(...)                                                   \
   BOOST_PP_IF(BOOST_PP_EQUAL(BOOST_PP_VARIADIC_SIZE(__VA_ARGS__), 2), \
               CIMLOG_2, CIMLOG_3)                                     \
   (__VA_ARGS__)
 
-#define CIMLOG_2(module_name, severity)                              \
-  BOOST_LOG_CHANNEL_SEV(ChanelLogger::get(), #module_name, severity) \
-      << cilogger_file_name(__FILE__) << "::" << __FUNCTION__ << ":" \
-      << __LINE__ << ":" << syscall(SYS_gettid) << "," << #module_name << ","
+#define CIMLOG_2(module_name, severity) \
+  CASTIS_CILOG_STREAM(#module_name, #module_name, severity)
 
-#define CIMLOG_3(module_name, severity, fmt_str, ...)                         \
-  BOOST_LOG_CHANNEL_SEV(ChanelLogger::get(), #module_name, severity)          \
-      << cilogger_file_name(__FILE__) << "::" << __FUNCTION__ << ":"          \
-      << __LINE__ << ":" << syscall(SYS_gettid) << "," << #module_name << "," \
-      << fmt::format(FMT_STRING(fmt_str), ##__VA_ARGS__)
+#define CIMLOG_3(module_name, severity, fmt_str, ...)                      \
+  CASTIS_CILOG_FORMAT(#module_name, #module_name, severity, fmt_str, \
+                      ##__VA_ARGS__)
 
 #define CILOG(...)                                                             \
   BOOST_PP_IF(BOOST_PP_EQUAL(BOOST_PP_VARIADIC_SIZE(__VA_ARGS__), 1), CILOG_1, \
               CILOG_2)                                                         \
   (__VA_ARGS__)
 
-#define CILOG_1(severity)                                                  \
-  BOOST_LOG_CHANNEL_SEV(ChanelLogger::get(), CASTIS_CILOG_DEFAULT_MODULUE, \
-                        severity)                                          \
-      << cilogger_file_name(__FILE__) << "::" << __FUNCTION__ << ":"       \
-      << __LINE__ << ":" << syscall(SYS_gettid) << ",,"
+#define CILOG_1(severity) \
+  CASTIS_CILOG_STREAM(CASTIS_CILOG_DEFAULT_MODULUE, "", severity)
+
+#define CILOG_2(severity, fmt_str, ...)                               \
+  CASTIS_CILOG_FORMAT(CASTIS_CILOG_DEFAULT_MODULUE, "", severity, fmt_str, \
+                      ##__VA_ARGS__)
+
+// The rate limiter of a call site, see detail::rate_limiter
+#define CASTIS_CILOG_RATE_LIMITER(per_second)                       \
+  []() -> ::castis::logger::detail::rate_limiter& {                 \
+    static ::castis::logger::detail::rate_limiter limiter(per_second); \
+    return limiter;                                                 \
+  }()
+
+// A statement over the rate of its call site is dropped before a record is
+// opened or the arguments are formatted. The next one let through starts
+// with "(suppressed K similar messages) ".
+#define CASTIS_CILOG_STREAM_LIMITED(chan, module_text, lvl, per_second)      \
+  if (!::castis::logger::detail::severity_enabled(lvl)) {                    \
+  } else if (auto const _cilog_suppressed_ =                                 \
+                 CASTIS_CILOG_RATE_LIMITER(per_second).acquire();            \
+             _cilog_suppressed_ < 0) {                                       \
+  } else                                                                     \
+    CASTIS_CILOG_RECORD(chan, module_text, lvl)                              \
+        << ::castis::logger::detail::suppressed_count{_cilog_suppressed_}
+
+#define CASTIS_CILOG_FORMAT_LIMITED(chan, module_text, lvl, per_second,      \
+                                    fmt_str, ...)                            \
+  if (!::castis::logger::detail::severity_enabled(lvl)) {                    \
+  } else if (auto const _cilog_suppressed_ =                                 \
+                 CASTIS_CILOG_RATE_LIMITER(per_second).acquire();            \
+             _cilog_suppressed_ < 0) {                                       \
+  } else if (_cilog_suppressed_ > 0) {                                       \
+    CASTIS_CILOG_FORMAT(chan, module_text, lvl,                              \
+                        "(suppressed {} similar messages) " fmt_str,         \
+                        _cilog_suppressed_, ##__VA_ARGS__);                  \
+  } else                                                                     \
+    CASTIS_CILOG_FORMAT(chan, module_text, lvl, fmt_str, ##__VA_ARGS__)
+
+// CILOG/CIMLOG letting through at most per_second statements a second from
+// each call site, with bursts of up to per_second statements:
+// CILOG_RATE_LIMITED(10, error, "retry {} failed", url);
+#define CIMLOG_RATE_LIMITED(...)                                      \
+  BOOST_PP_IF(BOOST_PP_EQUAL(BOOST_PP_VARIADIC_SIZE(__VA_ARGS__), 3), \
+              CIMLOG_RATE_LIMITED_3, CIMLOG_RATE_LIMITED_4)           \
+  (__VA_ARGS__)
+
+#define CIMLOG_RATE_LIMITED_3(per_second, module_name, severity) \
+  CASTIS_CILOG_STREAM_LIMITED(#module_name, #module_name, severity, per_second)
+
+#define CIMLOG_RATE_LIMITED_4(per_second, module_name, severity, fmt_str, \
+                              ...)                                        \
+  CASTIS_CILOG_FORMAT_LIMITED(#module_name, #module_name, severity,       \
+                              per_second, fmt_str, ##__VA_ARGS__)
+
+#define CILOG_RATE_LIMITED(...)                                       \
+  BOOST_PP_IF(BOOST_PP_EQUAL(BOOST_PP_VARIADIC_SIZE(__VA_ARGS__), 2), \
+              CILOG_RATE_LIMITED_2, CILOG_RATE_LIMITED_3)             \
+  (__VA_ARGS__)
+
+#define CILOG_RATE_LIMITED_2(per_second, severity)                    \
+  CASTIS_CILOG_STREAM_LIMITED(CASTIS_CILOG_DEFAULT_MODULUE, "", severity, \
+                              per_second)
 
-#define CILOG_2(severity, fmt_str, ...)                                    \
-  BOOST_LOG_CHANNEL_SEV(ChanelLogger::get(), CASTIS_CILOG_DEFAULT_MODULUE, \
-                        severity)                                          \
-      << cilogger_file_name(__FILE__) << "::" << __FUNCTION__ << ":"       \
-      << __LINE__ << ":" << syscall(SYS_gettid) << ",,"                    \
-      << fmt::format(FMT_STRING(fmt_str), ##__VA_ARGS__)
+#define CILOG_RATE_LIMITED_3(per_second, severity, fmt_str, ...)          \
+  CASTIS_CILOG_FORMAT_LIMITED(CASTIS_CILOG_DEFAULT_MODULUE, "", severity, \
+                              per_second, fmt_str, ##__VA_ARGS__)
 
 enum severity_level {
   foo,
@@ -90,77 +213,706 @@ boost::log::formatting_ostream& operator<<(
     boost::log::formatting_ostream& strm,
     boost::log::to_log_manip<severity_level, severity_tag> const& manip);
 
+namespace castis {
+namespace logger {
+// When the file backends write out the lines they have buffered. Any trigger
+// that is set flushes, a bool keeps the old auto_flush behaviour: flush every
+// line or only when the buffer is full. Asynchronous sinks defer a due flush
+// until their queue runs dry, so a backed up queue is written in batches.
+struct FlushPolicy {
+  FlushPolicy(bool auto_flush = true) : bytes_(auto_flush ? 1 : 0) {}
+  FlushPolicy(std::chrono::milliseconds interval, std::size_t bytes = 0,
+              std::optional<severity_level> severity = std::nullopt)
+      : interval_(interval), bytes_(bytes), severity_(severity) {}
+
+  // the oldest unflushed line is this old, asynchronous sinks also check it
+  // from the sink thread while no records arrive
+  std::chrono::milliseconds interval_{0};
+  // this many bytes are unflushed
+  std::size_t bytes_{0};
+  // a line at or above this level is written
+  std::optional<severity_level> severity_;
+  // a flush of the io_uring backend also fdatasyncs the file, the other
+  // backends leave the written lines to the page cache
+  bool sync_{false};
+};
+
+// When cilog_backend starts a new file: at the size and at every interval
+// boundary of the local time. An integer keeps the old behaviour, rotate at
+// that size and at midnight.
+struct RotationPolicy {
+  RotationPolicy(uintmax_t size = 10 * 1024 * 1024) : size_(size) {}
+  RotationPolicy(uintmax_t size, std::chrono::minutes interval)
+      : size_(size), interval_(interval) {}
+
+  uintmax_t size_{10 * 1024 * 1024};
+  // a day, an hour or a divisor of an hour (10, 15, 30 minutes, ...)
+  std::chrono::minutes interval_{std::chrono::hours(24)};
+  // keeps the index of the current file in <target>/.<name>.index so that a
+  // restart does not have to scan the month directory for it
+  bool state_file_{false};
+};
+
+// Called on the sink thread with a file the backend rotated out and will not
+// write again, once the next file is open and the symlink points to it
+using rotated_file_handler =
+    std::function<void(std::filesystem::path const&)>;
+
+namespace detail {
+// The next local time boundary of a rotation interval kept as a steady_clock
+// deadline, so the per record check is one compare. The wall clock is read
+// again at the deadline and at least once a minute before it, which takes
+// DST changes and wall clock jumps in either direction into account.
+class rotation_schedule {
+ public:
+  explicit rotation_schedule(std::chrono::minutes interval)
+      : interval_(interval) {}
+
+  // Starts the interval containing now, called when a file is opened
+  void start(std::time_t now = std::time(nullptr));
+  bool due(std::chrono::steady_clock::time_point now) {
+    return now >= check_at_ && check_wall_clock(std::time(nullptr));
+  }
+  // True when the wall clock reached the boundary or was set back more than
+  // kBackwardsTolerance before the interval. Smaller steps back, like an NTP
+  // correction right after a boundary, keep the current file rather than
+  // reopening one named after the previous interval.
+  bool check_wall_clock(std::time_t now);
+  // Local time the current interval started at, files are named after it
+  std::time_t interval_start() const { return interval_start_; }
+
+  static constexpr std::time_t kBackwardsTolerance = 60;
+
+ private:
+  void arm(std::time_t now);
+
+  std::chrono::minutes interval_;
+  std::time_t interval_start_{0};
+  std::time_t boundary_{0};
+  std::chrono::steady_clock::time_point check_at_;
+};
+
+// Unflushed bytes and their age in a backend, checked against its policy
+class flush_state {
+ public:
+  explicit flush_state(FlushPolicy const& policy) : policy_(policy) {}
+
+  // Accounts a buffered line, true when the backend has to flush
+  bool written(std::size_t size, boost::log::record_view const& rec);
+  // The flush is asked for by the interval, bytes_ or severity_ of the
+  // policy rather than by auto_flush flushing every line, batching backends
+  // do it right away instead of when their queue runs dry
+  bool urgent() const { return urgent_; }
+  // True when a line asked for a flush or unflushed lines are older than the
+  // policy's interval
+  bool due() const;
+  void flushed() {
+    unflushed_bytes_ = 0;
+    due_ = false;
+    urgent_ = false;
+  }
+
+ private:
+  FlushPolicy policy_;
+  std::size_t unflushed_bytes_{0};
+  bool due_{false};
+  bool urgent_{false};
+  std::chrono::steady_clock::time_point first_unflushed_;
+};
+
+// Holds back lines repeating the previous one, a run of them is written as
+// one "last message repeated N times" line. Lines are compared by what
+// follows the timestamp, the first four columns of a CILOG line (app,
+// version, date and time), its hash first.
+class duplicate_collapser {
+ public:
+  void enable(std::chrono::milliseconds max_delay) {
+    enabled_ = true;
+    max_delay_ = max_delay;
+  }
+  bool enabled() const { return enabled_; }
+  // True when line repeats the previous one and is only counted, otherwise
+  // the next lines are compared with it
+  bool repeated(std::string_view line,
+                std::chrono::steady_clock::time_point now);
+  // The run has been held back for max_delay
+  bool due(std::chrono::steady_clock::time_point now) const {
+    return repeats_ > 0 && now - first_repeat_ >= max_delay_;
+  }
+  // Ends the run, out is the columns of its last line before the message
+  // followed by "last message repeated N times". False without repeats.
+  bool take_repeats(std::string& out);
+
+ private:
+  bool enabled_{false};
+  std::chrono::milliseconds max_delay_{0};
+  bool has_previous_{false};
+  std::size_t hash_{0};
+  // what follows the timestamp in the previous line
+  std::string previous_;
+  std::uint64_t repeats_{0};
+  std::chrono::steady_clock::time_point first_repeat_;
+  std::string last_prefix_;
+};
+
+// Append-only log file written with plain write(2). Lines are collected in
+// a buffer and handed to the kernel together, one syscall per batch.
+class batch_file {
+ public:
+  // a full buffer is written even if no flush is due
+  static constexpr std::size_t kBatchSize = 64 * 1024;
+
+  batch_file() = default;
+  batch_file(batch_file const&) = delete;
+  batch_file& operator=(batch_file const&) = delete;
+  ~batch_file() { close(); }
+
+  // expected_size is only used by files that preallocate
+  bool open(std::filesystem::path const& path, uintmax_t expected_size = 0);
+  // Writes what is buffered and closes the file
+  void close();
+  bool is_open() const { return fd_ >= 0; }
+  // False once a write has failed, until the file is reopened
+  bool good() const { return good_; }
+  // Size of the file when it was opened
+  uintmax_t opened_size() const { return opened_size_; }
+
+  // Buffers the line and a newline
+  void append(std::string_view line);
+  void write_pending();
+
+ private:
+  int fd_{-1};
+  bool good_{true};
+  uintmax_t opened_size_{0};
+  std::string buffer_;
+};
+
+// Log file preallocated to the expected size and written through a shared
+// mapping, so appending a line is a memcpy. The mapping grows when a line
+// does not fit, and the file is truncated to what was written when it is
+// closed. Readers see the preallocated tail as NUL bytes until then, and a
+// file left behind by a crash is continued after its last non-NUL byte.
+class mapped_file {
+ public:
+  mapped_file() = default;
+  mapped_file(mapped_file const&) = delete;
+  mapped_file& operator=(mapped_file const&) = delete;
+  ~mapped_file() { close(); }
+
+  bool open(std::filesystem::path const& path, uintmax_t expected_size = 0);
+  // Truncates the file to the written length and closes it
+  void close();
+  bool is_open() const { return fd_ >= 0; }
+  // False once the file could not be extended, until it is reopened
+  bool good() const { return good_; }
+  uintmax_t opened_size() const { return opened_size_; }
+
+  void append(std::string_view line);
+  // Starts writeback (msync MS_ASYNC) of the pages written since the last
+  // call, the lines are visible to readers of the page cache already
+  void write_pending();
+
+ private:
+  bool reserve(std::size_t capacity);
+
+  int fd_{-1};
+  bool good_{true};
+  uintmax_t opened_size_{0};
+  char* data_{nullptr};
+  std::size_t capacity_{0};
+  std::size_t size_{0};
+  std::size_t synced_{0};
+};
+
+// Log file written through io_uring from a few registered buffers with the
+// file registered as a fixed file. A full buffer or a flush is submitted as
+// one write and the sink thread only waits when every buffer is still being
+// written. With set_sync a flush also queues an fdatasync that waits for
+// every earlier write (IOSQE_IO_DRAIN). At most one is in flight, a flush
+// meanwhile is synced by the next submit or by close. Without io_uring (old
+// kernel, seccomp) it writes like batch_file.
+class uring_file {
+ public:
+  static constexpr std::size_t kBatchSize = batch_file::kBatchSize;
+  static constexpr unsigned kBuffers = 4;
+
+  uring_file();
+  uring_file(uring_file const&) = delete;
+  uring_file& operator=(uring_file const&) = delete;
+  ~uring_file();
+
+  bool open(std::filesystem::path const& path, uintmax_t expected_size = 0);
+  // Waits for the writes in flight and closes the file
+  void close();
+  bool is_open() const;
+  bool good() const;
+  uintmax_t opened_size() const;
+
+  void append(std::string_view line);
+  // Submits the buffered lines, and an fdatasync when set_sync asked for it
+  void write_pending();
+  void set_sync(bool sync) { sync_ = sync; }
+
+  // False when the writes fall back to write(2)
+  bool uses_ring() const { return ring_ != nullptr; }
+
+ private:
+  struct ring;
+  std::unique_ptr<ring> ring_;
+  batch_file fallback_;
+  bool sync_{false};
+};
+}  // namespace detail
+}  // namespace logger
+}  // namespace castis
+
 class cilog_date_hour_backend
     : public boost::log::sinks::basic_formatted_sink_backend<
-          char, boost::log::sinks::synchronized_feeding> {
+          char, boost::log::sinks::combine_requirements<
+                    boost::log::sinks::synchronized_feeding,
+                    boost::log::sinks::flushing>::type> {
  private:
-  bool auto_flush_{};
-  std::ofstream file_;
+  castis::logger::detail::flush_state flush_state_;
+  castis::logger::detail::batch_file file_;
+  bool batching_{false};
+  castis::logger::detail::duplicate_collapser collapser_;
+  boost::log::record_view repeat_record_;
+  std::string repeat_line_;
+  std::shared_ptr<castis::logger::detail::sink_telemetry> telemetry_;
+  castis::logger::detail::rotation_schedule schedule_;
+  castis::logger::rotated_file_handler rotated_file_handler_;
+  std::filesystem::path rotated_path_;
   std::filesystem::path target_path_;
   std::filesystem::path file_path_;
   std::string file_name_suffix_;
   std::string file_name_prefix_format_;
-  std::string current_date_hour_;
 
  public:
-  cilog_date_hour_backend(std::filesystem::path const& target_path,
-                          std::string_view file_name_suffix,
-                          std::string_view file_name_prefix_format,
-                          bool auto_flush);
-  void consume(boost::log::record_view const& /*rec*/,
+  // rotation_interval below an hour needs a prefix format with the minutes
+  cilog_date_hour_backend(
+      std::filesystem::path const& target_path,
+      std::string_view file_name_suffix,
+      std::string_view file_name_prefix_format,
+      castis::logger::FlushPolicy const& flush_policy,
+      std::chrono::minutes rotation_interval = std::chrono::hours(1));
+  void consume(boost::log::record_view const& rec,
                string_type const& formatted_message);
+  void flush();
+  // Flushes when the policy asks for it, called by the sink thread whenever
+  // its queue runs dry and every interval while no records arrive
+  void flush_if_due();
+  // Leaves the flushes of auto_flush to flush_if_due
+  void set_batching(bool batching) { batching_ = batching; }
+  void set_rotated_file_handler(castis::logger::rotated_file_handler handler) {
+    rotated_file_handler_ = std::move(handler);
+  }
+  // Back to back lines with the same message are written as the first one
+  // and a "last message repeated N times" line, when a different line comes,
+  // on flush or max_delay after the first repeat
+  void collapse_duplicates(std::chrono::milliseconds max_delay) {
+    collapser_.enable(max_delay);
+  }
+  // Writes a line that is not a record, such as the dropped records notice
+  void write_notice(std::string_view line);
+  // Counts the lines, bytes, flushes and rotations into the sink's counters
+  void set_telemetry(
+      std::shared_ptr<castis::logger::detail::sink_telemetry> telemetry) {
+    telemetry_ = std::move(telemetry);
+  }
 
  private:
+  void write_line(boost::log::record_view const& rec, std::string_view line);
+  void write_repeats();
   void rotate_file();
   std::filesystem::path generate_filepath();
-  std::string datetime_string_with_format(std::string_view format);
-  std::string get_current_date_hour();
+  std::string datetime_string_with_format(std::string_view format,
+                                          std::time_t time);
 };
 
-class cilog_backend : public boost::log::sinks::basic_formatted_sink_backend<
-                          char, boost::log::sinks::synchronized_feeding> {
+// File backend of the init_* functions, FileT is how the lines are written
+// (detail::batch_file or detail::mapped_file), the naming and rotation of the
+// files are the same for both
+template <typename FileT>
+class basic_cilog_backend
+    : public boost::log::sinks::basic_formatted_sink_backend<
+          char, boost::log::sinks::combine_requirements<
+                    boost::log::sinks::synchronized_feeding,
+                    boost::log::sinks::flushing>::type> {
  private:
-  bool auto_flush_{};
-  std::ofstream file_;
+  castis::logger::detail::flush_state flush_state_;
+  FileT file_;
+  bool batching_{false};
+  castis::logger::detail::duplicate_collapser collapser_;
+  boost::log::record_view repeat_record_;
+  std::string repeat_line_;
+  std::shared_ptr<castis::logger::detail::sink_telemetry> telemetry_;
+  castis::logger::detail::rotation_schedule schedule_;
+  // the date and index of the current file, known after the first scan
+  bool index_known_{false};
+  std::string index_prefix_;
+  uintmax_t current_index_{0};
+  // the next file continues with the next index (size or interval rotation)
+  bool advance_index_{false};
+  bool state_file_{false};
+  castis::logger::rotated_file_handler rotated_file_handler_;
+  std::filesystem::path rotated_path_;
   std::filesystem::path target_path_;
   std::filesystem::path file_path_;
   std::string file_name_suffix_;
   uintmax_t rotation_size_{};
   uintmax_t characters_written_{};
-  boost::gregorian::date current_date_;
 
  public:
-  cilog_backend(std::filesystem::path const& target_path,
-                std::string_view file_name_suffix, uintmax_t rotation_size,
-                bool auto_flush);
-  void consume(boost::log::record_view const& /*rec*/,
+  basic_cilog_backend(std::filesystem::path const& target_path,
+                      std::string_view file_name_suffix,
+                      castis::logger::RotationPolicy const& rotation,
+                      castis::logger::FlushPolicy const& flush_policy);
+  void consume(boost::log::record_view const& rec,
                string_type const& formatted_message);
+  void flush();
+  // Flushes when the policy asks for it, called by the sink thread whenever
+  // its queue runs dry and every interval while no records arrive
+  void flush_if_due();
+  // Leaves the flushes of auto_flush to flush_if_due
+  void set_batching(bool batching) { batching_ = batching; }
+  void set_rotated_file_handler(castis::logger::rotated_file_handler handler) {
+    rotated_file_handler_ = std::move(handler);
+  }
+  // Back to back lines with the same message are written as the first one
+  // and a "last message repeated N times" line, when a different line comes,
+  // on flush or max_delay after the first repeat
+  void collapse_duplicates(std::chrono::milliseconds max_delay) {
+    collapser_.enable(max_delay);
+  }
+  // Writes a line that is not a record, such as the dropped records notice
+  void write_notice(std::string_view line);
+  // Counts the lines, bytes, flushes and rotations into the sink's counters
+  void set_telemetry(
+      std::shared_ptr<castis::logger::detail::sink_telemetry> telemetry) {
+    telemetry_ = std::move(telemetry);
+  }
 
  private:
+  void write_line(boost::log::record_view const& rec, std::string_view line);
+  void write_repeats();
   void rotate_file();
   std::filesystem::path generate_filepath();
-  std::string datetime_string_with_format(std::string_view format);
+  std::string datetime_string_with_format(std::string_view format,
+                                          std::time_t time);
+  std::filesystem::path indexed_filepath(
+      std::filesystem::path const& monthly_path, std::string const& prefix,
+      uintmax_t index) const;
+  std::filesystem::path state_filepath() const;
+  bool read_state(std::filesystem::path const& monthly_path,
+                  std::string const& prefix, uintmax_t& next_index);
+  void write_state();
   uintmax_t scan_next_index(std::filesystem::path const& path,
                             std::regex const& pattern);
   uintmax_t parse_index(std::string const& filename);
 };
 
+extern template class basic_cilog_backend<castis::logger::detail::batch_file>;
+extern template class basic_cilog_backend<castis::logger::detail::mapped_file>;
+extern template class basic_cilog_backend<castis::logger::detail::uring_file>;
+
+using cilog_backend = basic_cilog_backend<castis::logger::detail::batch_file>;
+// Preallocated and memory mapped files, see detail::mapped_file
+using cilog_mmap_backend =
+    basic_cilog_backend<castis::logger::detail::mapped_file>;
+// io_uring writes, see detail::uring_file
+using cilog_uring_backend =
+    basic_cilog_backend<castis::logger::detail::uring_file>;
+
 namespace castis {
 namespace logger {
+// Channel names are interned into small ids, records carry the id as the
+// "Channel" attribute and the sink filters compare ids
+using channel_id = std::uint32_t;
+constexpr channel_id kDefaultChannel = 0;  // CASTIS_CILOG_DEFAULT_MODULUE
+constexpr channel_id kAccessChannel = 1;   // "access"
+// ACCESSLOG statements AccessStatsOptions::log_every_ does not sample, only
+// the rollup sink takes them
+constexpr channel_id kAccessUnsampledChannel = 2;  // "access.unsampled"
+// the records of stats_reporter
+constexpr channel_id kStatsChannel = 3;  // "cilog_stats"
+
+// The same name always gets the same id, ids are never released
+channel_id intern_channel(std::string_view name);
+// Lock-free, called by the module filters for every record
+std::string_view channel_name(channel_id id);
+
+// Where a CILOG/CIMLOG statement is, rendered once as "file::func:line:" and
+// the module column. Records only carry a pointer to it (the "CallSite"
+// attribute) and the formatter stitches it in front of the message.
+struct CallSite {
+  CallSite(std::string_view file, std::string_view function, int line,
+           std::string_view module, std::string_view channel);
+  CallSite(CallSite const&) = delete;
+  CallSite& operator=(CallSite const&) = delete;
+
+  std::string prefix_;
+  std::string module_;
+  channel_id channel_;
+  boost::log::attribute_value value_;
+};
+
+// The format string of a CILOG(level, "fmt {}", args...) statement, registered
+// once per call site. Binary log entries only carry its id.
+struct FormatSite {
+  FormatSite(CallSite const& site, std::string_view format);
+  FormatSite(FormatSite const&) = delete;
+  FormatSite& operator=(FormatSite const&) = delete;
+
+  CallSite const& site_;
+  std::string_view format_;
+  std::uint32_t id_;
+};
+
+// Writes the record's message, formatting the arguments of a deferred
+// CILOG(level, "fmt {}", args...) statement. A custom formatter of a sink
+// with QueueOptions::deferred_format_ uses it instead of expr::smessage.
+void format_message(boost::log::record_view const& rec,
+                    boost::log::formatting_ostream& strm);
+
+namespace detail {
+FormatSite const* format_site(std::uint32_t id);
+
+// "Information" for info, nullptr for a level out of range
+const char* severity_name(severity_level level);
+
+// Opens a record on the site's channel with the call site and the calling
+// thread's cached tid attached
+boost::log::record open_record(CallSite const& site, severity_level level);
+
+// The same output as format_date_time "%Y-%m-%d,%H:%M:%S.%f"
+void format_timestamp(boost::posix_time::ptime const& timestamp,
+                      boost::log::formatting_ostream& strm);
+
+// The lowest level any sink accepts, see set_sink_severity_threshold
+inline std::atomic<int> min_severity_threshold{foo};
+
+inline bool severity_enabled(severity_level level) {
+  return level >= min_severity_threshold.load(std::memory_order_relaxed);
+}
+
+// Token bucket of a rate limited call site, kept as the time the bucket is
+// full again (GCRA) so a statement costs a clock read and one CAS. Bursts of
+// per_second statements pass, then one every 1/per_second seconds.
+class rate_limiter {
+ public:
+  explicit rate_limiter(std::uint32_t per_second)
+      : interval_(per_second > 0 ? kBurst / per_second : kBurst + 1) {}
+
+  // -1 when the statement is suppressed, otherwise the number of statements
+  // suppressed since the last one let through
+  std::int64_t acquire() {
+    auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+                   .count();
+    auto full_at = full_at_.load(std::memory_order_relaxed);
+    std::int64_t next;
+    do {
+      next = std::max(full_at, now) + interval_;
+      if (next - now > kBurst) {
+        suppressed_.fetch_add(1, std::memory_order_relaxed);
+        return -1;
+      }
+    } while (!full_at_.compare_exchange_weak(full_at, next,
+                                             std::memory_order_relaxed));
+    return suppressed_.exchange(0, std::memory_order_relaxed);
+  }
+
+ private:
+  static constexpr std::int64_t kBurst = 1000000000;  // a second in ns
+
+  const std::int64_t interval_;
+  std::atomic<std::int64_t> full_at_{0};
+  std::atomic<std::int64_t> suppressed_{0};
+};
+
+// Starts the message of a rate limited statement that follows suppressed ones
+struct suppressed_count {
+  std::int64_t count_;
+};
+
+inline boost::log::formatting_ostream& operator<<(
+    boost::log::formatting_ostream& strm, suppressed_count const& suppressed) {
+  if (suppressed.count_ > 0) {
+    strm << "(suppressed " << suppressed.count_ << " similar messages) ";
+  }
+  return strm;
+}
+
+void set_sink_threshold(void const* sink, int level);
+void remove_sink_threshold(void const* sink);
+
+// Set while every sink registered with a threshold formats deferred
+// messages, see QueueOptions::deferred_format_
+inline std::atomic<bool> deferred_format_active{false};
+
+void set_sink_deferred_format(void const* sink);
+
+// The format string and the encoded arguments of a deferred statement, the
+// record's "FormatArgs" attribute. Its "Message" is the same value, which
+// formats itself when extracted as a std::string.
+struct deferred_message {
+  std::string_view format_;
+  // the arguments of most statements fit in the attribute value itself
+  boost::container::small_vector<char, 64> args_;
+};
+
+void push_deferred(FormatSite const& site, severity_level level,
+                   std::string_view args);
+
+// Copies the arguments into a record formatted by the sink thread. False
+// when formatting is not deferred or an argument is not encodable_arg_v,
+// the statement is then formatted by the caller.
+template <typename... Args>
+bool log_deferred(FormatSite const& site, severity_level level,
+                  Args const&... args) {
+  if constexpr ((encodable_arg_v<Args> && ...)) {
+    if (!deferred_format_active.load(std::memory_order_relaxed)) return false;
+    auto& encoded = thread_encode_buffer();
+    encode_args(encoded, args...);
+    push_deferred(site, level, encoded);
+    return true;
+  } else {
+    return false;
+  }
+}
+
+// A CILOG(level, "fmt {}", args...) message formatted by the caller, written
+// to the record through the thread's format buffer instead of a temporary
+// string
+template <typename S, typename... Args>
+struct formatted_message {
+  S format_;
+  std::tuple<Args const&...> args_;
+};
+
+template <typename S, typename... Args>
+formatted_message<S, Args...> formatted(S const& format,
+                                        Args const&... args) {
+  return {format, std::tuple<Args const&...>(args...)};
+}
+
+template <typename S, typename... Args>
+boost::log::formatting_ostream& operator<<(
+    boost::log::formatting_ostream& strm,
+    formatted_message<S, Args...> const& message) {
+  auto& buffer = thread_format_buffer();
+  std::apply(
+      [&](Args const&... args) {
+        fmt::format_to(std::back_inserter(buffer), message.format_, args...);
+      },
+      message.args_);
+  strm.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+  return strm;
+}
+}  // namespace detail
+
+// CILOG/CIMLOG statements below the lowest level accepted by the registered
+// sinks are skipped before a record is opened. init_* register the sinks they
+// create and stop_logger removes them, a sink added or refiltered by hand
+// has to be registered with the lowest level its filter passes.
+inline void set_sink_severity_threshold(
+    boost::shared_ptr<boost::log::sinks::sink> const& sink,
+    severity_level level) {
+  detail::set_sink_threshold(sink.get(), level);
+}
+
+inline void remove_sink_severity_threshold(
+    boost::shared_ptr<boost::log::sinks::sink> const& sink) {
+  detail::remove_sink_threshold(sink.get());
+}
+
+// Sets the core filter to "Severity >= level" and raises the threshold with
+// it, foo removes the core filter
+void set_severity_threshold(severity_level level);
+
+using cilog_channel_logger_t =
+    boost::log::sources::severity_channel_logger_mt<severity_level,
+                                                    channel_id>;
 using cilog_sync_sink_t = boost::log::sinks::synchronous_sink<cilog_backend>;
-using cilog_async_sink_t = boost::log::sinks::asynchronous_sink<cilog_backend>;
+using cilog_async_sink_t =
+    boost::log::sinks::asynchronous_sink<cilog_backend, cilog_queue>;
+using cilog_mmap_async_sink_t =
+    boost::log::sinks::asynchronous_sink<cilog_mmap_backend, cilog_queue>;
+using cilog_uring_async_sink_t =
+    boost::log::sinks::asynchronous_sink<cilog_uring_backend, cilog_queue>;
 using cilog_date_hour_async_sink_t =
-    boost::log::sinks::asynchronous_sink<cilog_date_hour_backend>;
+    boost::log::sinks::asynchronous_sink<cilog_date_hour_backend, cilog_queue>;
+
+namespace detail {
+// Asynchronous sinks flush the lines of auto_flush from their thread once the
+// queue runs dry, and every interval while no records arrive so the last
+// lines of a burst do not wait for the next one. The interval, bytes_ and
+// severity_ of a FlushPolicy still flush as soon as a line meets them.
+template <typename SinkT>
+void set_idle_flush(SinkT* sink, FlushPolicy const& policy) {
+  sink->locked_backend()->set_batching(true);
+  sink->set_idle_handler(policy.interval_, [sink] {
+    sink->locked_backend()->flush_if_due();
+  });
+}
+
+// Sets the sink's filter, counting the records it turns down, and has the
+// backend update the sink's telemetry (see cilog_queue::stats)
+template <typename SinkT>
+void set_telemetry_filter(SinkT* sink, boost::log::filter filter) {
+  auto telemetry = sink->telemetry();
+  sink->locked_backend()->set_telemetry(telemetry);
+  sink->set_filter([filter = std::move(filter), telemetry](
+                       boost::log::attribute_value_set const& values) {
+    if (filter(values)) return true;
+    telemetry->this_thread_counters().filtered_.fetch_add(
+        1, std::memory_order_relaxed);
+    return false;
+  });
+}
+
+// "<app>,<version>,<date>,<time>,Warning,,,dropped N records"
+std::string dropped_records_line(std::string_view app_name,
+                                 std::string_view app_version,
+                                 std::uint64_t dropped);
+
+// Records dropped by the QueueOptions::overflow_ policy are reported in the
+// sink's own file
+template <typename SinkT>
+void set_drop_notice(SinkT* sink, std::string app_name,
+                     std::string app_version) {
+  sink->set_drop_handler([sink, app_name, app_version](std::uint64_t dropped) {
+    sink->locked_backend()->write_notice(
+        dropped_records_line(app_name, app_version, dropped));
+  });
+}
+}  // namespace detail
 
 void init_logger(std::string app_name, std::string app_version,
                  std::string_view target = "./log",
-                 int64_t rotation_size = 10 * 1024 * 1024,
-                 bool auto_flush = true);
+                 RotationPolicy rotation = 10 * 1024 * 1024,
+                 FlushPolicy flush_policy = true);
 
 boost::shared_ptr<cilog_async_sink_t> init_async_logger(
     std::string app_name, std::string app_version,
-    std::string_view target = "./log", int64_t rotation_size = 10 * 1024 * 1024,
-    bool auto_flush = true);
+    std::string_view target = "./log",
+    RotationPolicy rotation = 10 * 1024 * 1024,
+    FlushPolicy flush_policy = true, QueueOptions queue = {});
+
+// init_async_logger writing through cilog_mmap_backend
+boost::shared_ptr<cilog_mmap_async_sink_t> init_async_mmap_logger(
+    std::string app_name, std::string app_version,
+    std::string_view target = "./log",
+    RotationPolicy rotation = 10 * 1024 * 1024,
+    FlushPolicy flush_policy = true, QueueOptions queue = {});
+
+// init_async_logger writing through cilog_uring_backend
+boost::shared_ptr<cilog_uring_async_sink_t> init_async_uring_logger(
+    std::string app_name, std::string app_version,
+    std::string_view target = "./log",
+    RotationPolicy rotation = 10 * 1024 * 1024,
+    FlushPolicy flush_policy = true, QueueOptions queue = {});
 
 struct Module {
   enum { min_level, specific_level };
@@ -184,18 +936,41 @@ struct Module {
 };
 
 bool func_module_severity_filter(
-    boost::log::value_ref<std::string> const& ch,
+    boost::log::value_ref<channel_id> const& ch,
     boost::log::value_ref<severity_level> const& level,
     const std::vector<Module>& modules);
 
+// A Module list compiled into a table from channel id to a bitmask of the
+// accepted levels. The module names are interned when the table is built and
+// the first matching module and the "empty name matches every channel but
+// access" rule are resolved there, so filtering a record is one index.
+class module_filter_table {
+ public:
+  explicit module_filter_table(std::vector<Module> const& modules);
+
+  bool accepts(channel_id channel, severity_level level) const;
+
+ private:
+  // indexed by the ids of the named modules and access
+  std::vector<std::uint16_t> masks_;
+  // channels without their own module
+  std::uint16_t other_mask_{0};
+};
+
+bool func_module_table_filter(
+    boost::log::value_ref<channel_id> const& ch,
+    boost::log::value_ref<severity_level> const& level,
+    module_filter_table const& table);
+
 boost::shared_ptr<cilog_async_sink_t> init_async_module_logger(
     std::string app_name, std::string app_version,
     const std::vector<Module>& filters, std::string_view file_name_suffix,
-    std::string_view target = "./log", int64_t rotation_size = 10 * 1024 * 1024,
-    bool auto_flush = true);
+    std::string_view target = "./log",
+    RotationPolicy rotation = 10 * 1024 * 1024,
+    FlushPolicy flush_policy = true, QueueOptions queue = {});
 
 bool func_module_ptr_severity_filter(
-    boost::log::value_ref<std::string> const& ch,
+    boost::log::value_ref<channel_id> const& ch,
     boost::log::value_ref<severity_level> const& level,
     const std::vector<std::shared_ptr<Module>>& modules);
 
@@ -203,13 +978,14 @@ boost::shared_ptr<cilog_async_sink_t> init_async_module_logger(
     std::string app_name, std::string app_version,
     const std::vector<std::shared_ptr<Module>>& filters,
     std::string_view file_name_suffix, std::string_view target = "./log",
-    int64_t rotation_size = 10 * 1024 * 1024, bool auto_flush = true);
+    RotationPolicy rotation = 10 * 1024 * 1024,
+    FlushPolicy flush_policy = true, QueueOptions queue = {});
 
 boost::shared_ptr<cilog_date_hour_async_sink_t> init_async_date_hour_logger(
     std::string app_name, std::string app_version,
     std::string_view target = "./log",
     std::string_view file_name_prefix_format = "{:%Y-%m-%d[%H]}",
-    bool auto_flush = true);
+    FlushPolicy flush_policy = true, QueueOptions queue = {});
 
 bool func_severity_filter(boost::log::value_ref<severity_level> const& level,
                           const std::vector<severity_level>& severity_levels);
@@ -218,7 +994,8 @@ boost::shared_ptr<cilog_async_sink_t> init_async_level_logger(
     std::string app_name, std::string app_version,
     const std::vector<severity_level> severity_levels,
     std::string_view file_name_suffix, std::string_view target = "./log",
-    int64_t rotation_size = 10 * 1024 * 1024, bool auto_flush = true);
+    RotationPolicy rotation = 10 * 1024 * 1024,
+    FlushPolicy flush_policy = true, QueueOptions queue = {});
 
 boost::shared_ptr<cilog_date_hour_async_sink_t>
 init_async_date_hour_level_logger(
@@ -226,12 +1003,13 @@ init_async_date_hour_level_logger(
     const std::vector<severity_level> severity_levels,
     std::string_view file_name_suffix, std::string_view target = "./log",
     std::string_view file_name_prefix_format = "{:%Y-%m-%d[%H]}",
-    bool auto_flush = true);
+    FlushPolicy flush_policy = true, QueueOptions queue = {});
 
 template <typename Sink>
 void stop_logger(Sink sink) {
   auto core = boost::log::core::get();
   core->remove_sink(sink);
+  remove_sink_severity_threshold(sink);
   sink->stop();
   sink->flush();
   sink.reset();
@@ -245,4 +1023,8 @@ BOOST_LOG_INLINE_GLOBAL_LOGGER_DEFAULT(
 
 BOOST_LOG_INLINE_GLOBAL_LOGGER_DEFAULT(
     ChanelLogger,
-    boost::log::sources::severity_channel_logger_mt<severity_level>)
+    castis::logger::cilog_channel_logger_t)
+
+#ifdef CASTIS_CILOG_BINARY
+#include "castisbinlog.h"
+#endif
@@ -0,0 +1,718 @@
+#include "logger/castisqueue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/log/attributes/value_extraction.hpp>
+
+#include "logger/castislogger.h"
+
+namespace castis {
+namespace logger {
+namespace detail {
+namespace {
+
+constexpr std::size_t kCacheLineSize = 64;
+
+// The same behaviour as boost::log's unbounded_fifo_queue: a mutex around a
+// deque and a condition variable signaled when the queue becomes non-empty.
+class locked_record_queue final : public record_queue {
+ private:
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<boost::log::record_view> queue_;
+  bool interruption_requested_{false};
+
+ public:
+  void enqueue(boost::log::record_view const& rec) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(rec);
+    if (queue_.size() == 1) cond_.notify_one();
+  }
+
+  bool try_enqueue(boost::log::record_view const& rec) override {
+    std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+    if (!lock.owns_lock()) return false;
+    queue_.push_back(rec);
+    if (queue_.size() == 1) cond_.notify_one();
+    return true;
+  }
+
+  bool try_dequeue(boost::log::record_view& rec) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queue_.empty()) return false;
+    rec.swap(queue_.front());
+    queue_.pop_front();
+    return true;
+  }
+
+  bool dequeue_ready(boost::log::record_view& rec,
+                     std::chrono::steady_clock::time_point deadline) override {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!interruption_requested_) {
+      if (!queue_.empty()) {
+        rec.swap(queue_.front());
+        queue_.pop_front();
+        return true;
+      }
+      if (deadline == std::chrono::steady_clock::time_point::max()) {
+        cond_.wait(lock);
+      } else if (cond_.wait_until(lock, deadline) ==
+                 std::cv_status::timeout) {
+        return false;
+      }
+    }
+    interruption_requested_ = false;
+    return false;
+  }
+
+  void interrupt_dequeue() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    interruption_requested_ = true;
+    cond_.notify_one();
+  }
+};
+
+// Parks the single consumer thread on a condition variable. Producers only
+// take the mutex to signal it when it is actually parked.
+class consumer_parking {
+ private:
+  alignas(kCacheLineSize) std::atomic<bool> parked_{false};
+  std::mutex mutex_;
+  std::condition_variable cond_;
+
+ public:
+  template <typename ReadyT>
+  void park(ReadyT ready, std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    parked_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // the 100ms only bounds the cost of a missed wakeup
+    if (!ready()) {
+      cond_.wait_until(lock,
+                       std::min(deadline, std::chrono::steady_clock::now() +
+                                              std::chrono::milliseconds(100)));
+    }
+    parked_.store(false, std::memory_order_relaxed);
+  }
+
+  void wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parked_.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cond_.notify_one();
+    }
+  }
+};
+
+void backoff(unsigned spins) {
+  if (spins < 64)
+    std::this_thread::yield();
+  else
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+std::size_t round_up_pow2(std::size_t n) {
+  std::size_t size = 2;
+  while (size < n) size <<= 1;
+  return size;
+}
+
+// Bounded multi-producer ring of preallocated slots (D. Vyukov's sequence
+// numbered array queue). Producers only touch the tail counter and their own
+// slot, so enqueue costs one CAS regardless of the number of threads.
+class ring_record_queue final : public record_queue {
+ private:
+  struct alignas(kCacheLineSize) slot {
+    std::atomic<std::size_t> sequence_;
+    boost::log::record_view rec_;
+  };
+
+  std::vector<slot> slots_;
+  std::size_t mask_;
+  alignas(kCacheLineSize) std::atomic<std::size_t> tail_{0};
+  alignas(kCacheLineSize) std::atomic<std::size_t> head_{0};
+  std::atomic<bool> interruption_requested_{false};
+  consumer_parking parking_;
+
+ public:
+  explicit ring_record_queue(std::size_t capacity)
+      : slots_(round_up_pow2(capacity)), mask_(slots_.size() - 1) {
+    for (std::size_t i = 0; i < slots_.size(); ++i) {
+      slots_[i].sequence_.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  void enqueue(boost::log::record_view const& rec) override {
+    for (unsigned spins = 0; !push(rec); ++spins) backoff(spins);
+    parking_.wake();
+  }
+
+  bool try_enqueue(boost::log::record_view const& rec) override {
+    if (!push(rec)) return false;
+    parking_.wake();
+    return true;
+  }
+
+  bool try_dequeue(boost::log::record_view& rec) override {
+    std::size_t pos = head_.load(std::memory_order_relaxed);
+    for (;;) {
+      slot& s = slots_[pos & mask_];
+      auto seq = s.sequence_.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq - (pos + 1));
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          rec.swap(s.rec_);
+          s.rec_ = boost::log::record_view();
+          s.sequence_.store(pos + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool dequeue_ready(boost::log::record_view& rec,
+                     std::chrono::steady_clock::time_point deadline) override {
+    for (;;) {
+      if (try_dequeue(rec)) return true;
+      if (interruption_requested_.exchange(false, std::memory_order_acquire))
+        return false;
+      if (std::chrono::steady_clock::now() >= deadline) return false;
+      parking_.park(
+          [this] {
+            return ready() ||
+                   interruption_requested_.load(std::memory_order_relaxed);
+          },
+          deadline);
+    }
+  }
+
+  void interrupt_dequeue() override {
+    interruption_requested_.store(true, std::memory_order_release);
+    parking_.wake();
+  }
+
+  bool drop_oldest() override {
+    boost::log::record_view rec;
+    return try_dequeue(rec);
+  }
+
+  bool nearly_full() override {
+    auto size = tail_.load(std::memory_order_relaxed) -
+                head_.load(std::memory_order_relaxed);
+    return size >= slots_.size() - slots_.size() / 4;
+  }
+
+ private:
+  bool push(boost::log::record_view const& rec) {
+    std::size_t pos = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      slot& s = slots_[pos & mask_];
+      auto seq = s.sequence_.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          s.rec_ = rec;
+          s.sequence_.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool ready() const {
+    std::size_t pos = head_.load(std::memory_order_relaxed);
+    return slots_[pos & mask_].sequence_.load(std::memory_order_acquire) ==
+           pos + 1;
+  }
+};
+
+// Single-producer single-consumer ring owned by one logging thread. The
+// producer and the consumer each write only their own index, so pushing a
+// record never touches a cache line written by another producer.
+struct staging_buffer {
+  struct slot {
+    boost::log::record_view rec_;
+    std::chrono::steady_clock::time_point enqueued_;
+  };
+
+  std::vector<slot> slots_;
+  std::size_t mask_;
+  alignas(kCacheLineSize) std::atomic<std::size_t> tail_{0};
+  std::size_t cached_head_{0};
+  // the producer holds a record it could not push because the buffer is full
+  std::atomic<bool> blocked_{false};
+  alignas(kCacheLineSize) std::atomic<std::size_t> head_{0};
+  // consumer side cache of the head record's LineID
+  std::size_t seen_tail_{0};
+  bool head_keyed_{false};
+  unsigned int head_line_id_{0};
+  // set when the producer thread exits or the queue is destroyed
+  alignas(kCacheLineSize) std::atomic<bool> orphaned_{false};
+  std::atomic<bool> detached_{false};
+
+  explicit staging_buffer(std::size_t capacity)
+      : slots_(round_up_pow2(capacity)), mask_(slots_.size() - 1) {}
+
+  bool push(boost::log::record_view const& rec,
+            std::chrono::steady_clock::time_point now) {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_) return false;
+    }
+    slot& s = slots_[tail & mask_];
+    s.rec_ = rec;
+    s.enqueued_ = now;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  slot* front() {
+    auto head = head_.load(std::memory_order_relaxed);
+    seen_tail_ = tail_.load(std::memory_order_acquire);
+    return head == seen_tail_ ? nullptr : &slots_[head & mask_];
+  }
+
+  void pop(boost::log::record_view& rec) {
+    auto head = head_.load(std::memory_order_relaxed);
+    slot& s = slots_[head & mask_];
+    rec.swap(s.rec_);
+    s.rec_ = boost::log::record_view();
+    head_.store(head + 1, std::memory_order_release);
+    head_keyed_ = false;
+  }
+
+  bool has_new_records() const {
+    return tail_.load(std::memory_order_relaxed) != seen_tail_;
+  }
+
+  bool nearly_full() const {
+    auto size = tail_.load(std::memory_order_relaxed) -
+                head_.load(std::memory_order_relaxed);
+    return size >= slots_.size() - slots_.size() / 4;
+  }
+
+  // consumer side, seen_tail_ is the tail read by the last front()
+  bool full() const {
+    return seen_tail_ - head_.load(std::memory_order_relaxed) > mask_;
+  }
+};
+
+// The staging buffers of the calling thread, one per per_thread queue it has
+// logged into. Buffers are handed to the queue as orphans on thread exit and
+// freed by the sink thread once it has drained them.
+struct thread_staging_buffers {
+  std::vector<std::pair<std::uint64_t, std::shared_ptr<staging_buffer>>>
+      buffers_;
+
+  ~thread_staging_buffers() {
+    for (auto& b : buffers_) {
+      b.second->orphaned_.store(true, std::memory_order_release);
+    }
+  }
+};
+
+thread_local thread_staging_buffers t_staging_buffers;
+std::atomic<std::uint64_t> next_queue_id{1};
+
+class per_thread_record_queue final : public record_queue {
+ private:
+  using clock = std::chrono::steady_clock;
+
+  const std::uint64_t id_;
+  const std::size_t capacity_;
+  const clock::duration ordering_window_;
+  boost::log::attribute_name line_id_name_;
+
+  std::mutex registry_mutex_;
+  std::vector<std::shared_ptr<staging_buffer>> registered_;
+  alignas(kCacheLineSize) std::atomic<bool> registry_dirty_{false};
+
+  // consumer only
+  std::vector<std::shared_ptr<staging_buffer>> buffers_;
+  clock::time_point next_ready_;
+
+  std::atomic<bool> interruption_requested_{false};
+  consumer_parking parking_;
+
+ public:
+  per_thread_record_queue(std::size_t capacity,
+                          std::chrono::milliseconds ordering_window)
+      : id_(next_queue_id.fetch_add(1, std::memory_order_relaxed)),
+        capacity_(capacity ? capacity : 1024),
+        ordering_window_(ordering_window),
+        line_id_name_("LineID") {}
+
+  ~per_thread_record_queue() override {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    for (auto& b : registered_) {
+      b->detached_.store(true, std::memory_order_relaxed);
+    }
+    for (auto& b : buffers_) {
+      b->detached_.store(true, std::memory_order_relaxed);
+    }
+  }
+
+  void enqueue(boost::log::record_view const& rec) override {
+    auto& buffer = local_buffer();
+    auto now = clock::now();
+    if (!buffer.push(rec, now)) {
+      buffer.blocked_.store(true, std::memory_order_seq_cst);
+      for (unsigned spins = 0; !buffer.push(rec, now); ++spins) {
+        parking_.wake();
+        backoff(spins);
+      }
+      buffer.blocked_.store(false, std::memory_order_release);
+    }
+    parking_.wake();
+  }
+
+  bool try_enqueue(boost::log::record_view const& rec) override {
+    if (!local_buffer().push(rec, clock::now())) return false;
+    parking_.wake();
+    return true;
+  }
+
+  bool try_dequeue(boost::log::record_view& rec) override {
+    return merge_front(rec, false);
+  }
+
+  bool try_dequeue_ready(boost::log::record_view& rec) override {
+    return merge_front(rec, true);
+  }
+
+  bool dequeue_ready(boost::log::record_view& rec,
+                     clock::time_point deadline) override {
+    for (;;) {
+      if (merge_front(rec, true)) return true;
+      if (interruption_requested_.exchange(false, std::memory_order_acquire))
+        return false;
+      if (clock::now() >= deadline) return false;
+      if (next_ready_ != clock::time_point()) {
+        // records are held back for ordering, producers need not wake us
+        std::this_thread::sleep_until(std::min(next_ready_, deadline));
+        continue;
+      }
+      parking_.park([this] { return new_records_pending(); }, deadline);
+    }
+  }
+
+  void interrupt_dequeue() override {
+    interruption_requested_.store(true, std::memory_order_release);
+    parking_.wake();
+  }
+
+  bool nearly_full() override { return local_buffer().nearly_full(); }
+
+ private:
+  staging_buffer& local_buffer() {
+    auto& local = t_staging_buffers.buffers_;
+    for (auto& b : local) {
+      if (b.first == id_) return *b.second;
+    }
+    local.erase(std::remove_if(local.begin(), local.end(),
+                               [](auto const& b) {
+                                 return b.second->detached_.load(
+                                     std::memory_order_relaxed);
+                               }),
+                local.end());
+    auto buffer = std::make_shared<staging_buffer>(capacity_);
+    local.emplace_back(id_, buffer);
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    registered_.push_back(std::move(buffer));
+    registry_dirty_.store(true, std::memory_order_release);
+    return *local.back().second;
+  }
+
+  void adopt_registered() {
+    if (!registry_dirty_.load(std::memory_order_acquire)) return;
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    registry_dirty_.store(false, std::memory_order_relaxed);
+    for (auto& b : registered_) buffers_.push_back(std::move(b));
+    registered_.clear();
+  }
+
+  bool new_records_pending() {
+    if (interruption_requested_.load(std::memory_order_relaxed) ||
+        registry_dirty_.load(std::memory_order_relaxed))
+      return true;
+    for (auto& b : buffers_) {
+      if (b->has_new_records()) return true;
+    }
+    return false;
+  }
+
+  unsigned int line_id(boost::log::record_view const& rec) const {
+    auto it = rec.attribute_values().find(line_id_name_);
+    if (it == rec.attribute_values().end()) return 0;
+    auto value = it->second.extract<unsigned int>();
+    return value ? value.get() : 0;
+  }
+
+  // Takes the record with the smallest LineID among the buffer heads. The
+  // scan is linear in the number of producer threads, which is cheaper than
+  // maintaining a heap for the thread counts we run with.
+  bool merge_front(boost::log::record_view& rec, bool respect_window) {
+    adopt_registered();
+    next_ready_ = clock::time_point();
+
+    staging_buffer* best = nullptr;
+    staging_buffer::slot* best_slot = nullptr;
+    bool blocked_producer = false;
+    // a producer waits for room, holding records back only slows it down
+    bool backed_up = false;
+    for (std::size_t i = 0; i < buffers_.size();) {
+      auto* b = buffers_[i].get();
+      bool orphaned = b->orphaned_.load(std::memory_order_acquire);
+      bool blocked = b->blocked_.load(std::memory_order_acquire);
+      auto* s = b->front();
+      if (!s) {
+        // a producer that waited for room holds a record older than any
+        // other head, it is pushed as soon as the thread gets scheduled
+        blocked_producer = blocked_producer || blocked;
+        if (orphaned) {
+          buffers_[i].swap(buffers_.back());
+          buffers_.pop_back();
+        } else {
+          ++i;
+        }
+        continue;
+      }
+      backed_up = backed_up || blocked || b->full();
+      if (!b->head_keyed_) {
+        b->head_line_id_ = line_id(s->rec_);
+        b->head_keyed_ = true;
+      }
+      if (!best ||
+          static_cast<int>(b->head_line_id_ - best->head_line_id_) < 0) {
+        best = b;
+        best_slot = s;
+      }
+      ++i;
+    }
+    if (!best) return false;
+
+    if (respect_window && !backed_up) {
+      auto now = clock::now();
+      if (blocked_producer) {
+        next_ready_ = now + std::chrono::microseconds(100);
+        return false;
+      }
+      auto ready_at = best_slot->enqueued_ + ordering_window_;
+      if (now < ready_at) {
+        next_ready_ = ready_at;
+        return false;
+      }
+    }
+    best->pop(rec);
+    return true;
+  }
+};
+
+}  // namespace
+
+std::size_t sink_telemetry::thread_shard() {
+  static std::atomic<std::size_t> next_shard{0};
+  thread_local std::size_t shard =
+      next_shard.fetch_add(1, std::memory_order_relaxed) % kShards;
+  return shard;
+}
+
+std::uint64_t sink_telemetry::enqueued() const {
+  std::uint64_t sum = 0;
+  for (auto const& shard : producers_) {
+    sum += shard.enqueued_.load(std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+void sink_telemetry::record_enqueue_latency(std::chrono::nanoseconds latency) {
+  auto ns = static_cast<std::uint64_t>(std::max<std::int64_t>(
+      latency.count(), 1));
+  auto bucket = std::min<std::size_t>(63 - __builtin_clzll(ns),
+                                      SinkStats::kLatencyBuckets - 1);
+  this_thread_counters().enqueue_latency_[bucket].fetch_add(
+      1, std::memory_order_relaxed);
+}
+
+SinkStats sink_telemetry::snapshot() const {
+  auto load = [](std::atomic<std::uint64_t> const& counter) {
+    return counter.load(std::memory_order_relaxed);
+  };
+  SinkStats stats;
+  stats.taken_at_ = std::chrono::steady_clock::now();
+  // read the consumer side first, the depth cannot come out negative
+  auto dequeued = load(dequeued_);
+  stats.records_written_ = load(written_);
+  stats.records_dropped_ = load(dropped_);
+  stats.records_enqueued_ = enqueued();
+  for (auto const& shard : producers_) {
+    stats.records_filtered_ += load(shard.filtered_);
+    for (std::size_t i = 0; i < SinkStats::kLatencyBuckets; ++i) {
+      stats.enqueue_latency_[i] += load(shard.enqueue_latency_[i]);
+    }
+  }
+  auto gone = dequeued + stats.records_dropped_;
+  stats.queue_depth_ =
+      stats.records_enqueued_ > gone ? stats.records_enqueued_ - gone : 0;
+  stats.queue_high_water_ = std::max(load(high_water_), stats.queue_depth_);
+  stats.bytes_written_ = load(bytes_);
+  stats.flushes_ = load(flushes_);
+  stats.flush_time_ = std::chrono::nanoseconds(load(flush_ns_));
+  stats.rotations_ = load(rotations_);
+  stats.rotation_time_ = std::chrono::nanoseconds(load(rotation_ns_));
+  stats.index_scans_ = load(index_scans_);
+  stats.index_scan_time_ = std::chrono::nanoseconds(load(index_scan_ns_));
+  return stats;
+}
+
+std::unique_ptr<record_queue> make_record_queue(QueueOptions const& options) {
+  if (options.type_ == QueueOptions::per_thread) {
+    return std::make_unique<per_thread_record_queue>(options.capacity_,
+                                                     options.ordering_window_);
+  }
+  if (options.capacity_ == 0) return std::make_unique<locked_record_queue>();
+  return std::make_unique<ring_record_queue>(options.capacity_);
+}
+
+}  // namespace detail
+
+std::chrono::nanoseconds SinkStats::enqueue_latency(unsigned per_mille) const {
+  std::uint64_t total = 0;
+  for (auto count : enqueue_latency_) total += count;
+  if (total == 0) return std::chrono::nanoseconds(0);
+  auto rank = (total * per_mille + 999) / 1000;
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < kLatencyBuckets; ++i) {
+    seen += enqueue_latency_[i];
+    if (seen >= std::max<std::uint64_t>(rank, 1)) {
+      return std::chrono::nanoseconds((std::uint64_t(2) << i) - 1);
+    }
+  }
+  return std::chrono::nanoseconds((std::uint64_t(2) << (kLatencyBuckets - 1)));
+}
+
+double SinkStats::bytes_per_second(SinkStats const& earlier) const {
+  auto elapsed = std::chrono::duration<double>(taken_at_ - earlier.taken_at_);
+  if (elapsed.count() <= 0 || bytes_written_ < earlier.bytes_written_) return 0;
+  return (bytes_written_ - earlier.bytes_written_) / elapsed.count();
+}
+
+cilog_queue::cilog_queue(QueueOptions const& options)
+    : queue_(detail::make_record_queue(options)),
+      bounded_(options.capacity_ > 0 ||
+               options.type_ == QueueOptions::per_thread),
+      overflow_(options.overflow_),
+      block_timeout_(options.block_timeout_),
+      drop_severity_(options.drop_severity_),
+      telemetry_(std::make_shared<detail::sink_telemetry>()) {}
+
+void cilog_queue::enqueue_bounded(boost::log::record_view const& rec) {
+  if (!bounded_) {
+    queue_->enqueue(rec);
+    return;
+  }
+  if (overflow_ == QueueOptions::drop_below_severity &&
+      queue_->nearly_full()) {
+    auto level = boost::log::extract<severity_level>("Severity", rec);
+    if (!level || static_cast<int>(level.get()) < drop_severity_) {
+      count_dropped();
+      return;
+    }
+  }
+  if (queue_->try_enqueue(rec)) return;
+
+  if (overflow_ == QueueOptions::drop_oldest) {
+    // producers racing for the room made can need a few tries
+    for (int tries = 0; tries < 4 && queue_->drop_oldest(); ++tries) {
+      count_dropped();
+      if (queue_->try_enqueue(rec)) return;
+    }
+  } else if (overflow_ == QueueOptions::block ||
+             overflow_ == QueueOptions::drop_below_severity) {
+    auto deadline = block_timeout_.count() > 0
+                        ? std::chrono::steady_clock::now() + block_timeout_
+                        : std::chrono::steady_clock::time_point::max();
+    for (unsigned spins = 0; std::chrono::steady_clock::now() < deadline;
+         ++spins) {
+      detail::backoff(spins);
+      if (queue_->try_enqueue(rec)) return;
+    }
+  }
+  count_dropped();
+}
+
+void cilog_queue::count_dropped() {
+  dropped_.fetch_add(1, std::memory_order_relaxed);
+  telemetry_->dropped_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void cilog_queue::notify_dropped(bool drained) {
+  auto now = std::chrono::steady_clock::now();
+  if (!drained && now < next_drop_notice_) return;
+  std::function<void(std::uint64_t)> handler;
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    handler = drop_handler_;
+  }
+  if (!handler) {
+    // the telemetry still counts them, nothing is left to report
+    dropped_.store(0, std::memory_order_relaxed);
+    return;
+  }
+  next_drop_notice_ = now + std::chrono::seconds(1);
+  auto dropped = dropped_.exchange(0, std::memory_order_relaxed);
+  if (dropped != 0) handler(dropped);
+}
+
+void cilog_queue::set_drop_handler(
+    std::function<void(std::uint64_t)> handler) {
+  std::lock_guard<std::mutex> lock(idle_mutex_);
+  drop_handler_ = std::move(handler);
+}
+
+bool cilog_queue::dequeue_ready(boost::log::record_view& rec) {
+  std::chrono::milliseconds interval;
+  std::function<void()> handler;
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    interval = idle_interval_;
+    handler = idle_handler_;
+  }
+  if (dropped_.load(std::memory_order_relaxed) != 0) notify_dropped(true);
+  if (handler) handler();
+  auto deadline = (handler && interval.count() > 0)
+                      ? std::chrono::steady_clock::now() + interval
+                      : std::chrono::steady_clock::time_point::max();
+  if (!queue_->dequeue_ready(rec, deadline)) return false;
+  count_dequeued();
+  return true;
+}
+
+void cilog_queue::set_idle_handler(std::chrono::milliseconds interval,
+                                   std::function<void()> handler) {
+  std::lock_guard<std::mutex> lock(idle_mutex_);
+  idle_interval_ = interval;
+  idle_handler_ = std::move(handler);
+}
+
+}  // namespace logger
+}  // namespace castis
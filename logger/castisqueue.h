@@ -0,0 +1,319 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include <boost/log/core/record_view.hpp>
+#include <boost/parameter/keyword.hpp>
+
+namespace castis {
+namespace logger {
+
+// Record queue between the CILOG callers and the dedicated thread of the
+// asynchronous sinks returned by init_async_*
+struct QueueOptions {
+  enum { shared, per_thread };
+
+  QueueOptions(std::size_t capacity = 0, int type = shared)
+      : capacity_(capacity), type_(type) {}
+
+  // shared : 0 keeps the unbounded locking FIFO, otherwise the number of
+  //          records preallocated in the lock-free ring
+  // per_thread : the number of records in each thread's staging buffer
+  // (rounded up to a power of two)
+  std::size_t capacity_{0};
+  int type_{shared};
+  // per_thread buffers are merged by LineID in the sink thread, a record is
+  // held back until it is ordering_window_ old so that records of slower
+  // producers with a smaller LineID can still be merged in front of it.
+  // Records are not held back while a buffer is full, the order is then
+  // only kept among the records already in the buffers.
+  std::chrono::milliseconds ordering_window_{10};
+  // CILOG(level, "fmt {}", args...) copies the arguments into the record and
+  // the sink thread formats them, while every registered sink does so
+  bool deferred_format_{false};
+
+  // What a producer does when a bounded queue (capacity_ > 0 or per_thread)
+  // is full. A dropped record is counted and the sink writes "dropped N
+  // records" at most once a second. per_thread buffers cannot drop their
+  // oldest record from the producer side, drop_oldest drops the new one.
+  enum { block, drop_newest, drop_oldest, drop_below_severity };
+  int overflow_{block};
+  // block, drop_below_severity : how long a producer waits for room before
+  // the record is dropped, 0 waits as long as it takes
+  std::chrono::milliseconds block_timeout_{0};
+  // drop_below_severity : records below this severity_level are dropped
+  // once the queue is three quarters full, the others wait for room
+  int drop_severity_{0};
+};
+
+namespace keywords {
+BOOST_PARAMETER_KEYWORD(tag, queue_options)
+}  // namespace keywords
+
+// Counters of an asynchronous sink at one point in time, see
+// cilog_queue::stats
+struct SinkStats {
+  static constexpr std::size_t kLatencyBuckets = 32;
+
+  std::chrono::steady_clock::time_point taken_at_;
+  // records that passed the filter of the sink, including the dropped ones
+  std::uint64_t records_enqueued_{0};
+  std::uint64_t records_written_{0};
+  // records the sink's filter turned down
+  std::uint64_t records_filtered_{0};
+  // records dropped by QueueOptions::overflow_
+  std::uint64_t records_dropped_{0};
+  std::uint64_t queue_depth_{0};
+  // the deepest the queue was when the sink thread looked, every 64 records
+  std::uint64_t queue_high_water_{0};
+  // one in 64 enqueue calls of each thread is timed, bucket i counts the
+  // calls that took [2^i, 2^(i+1)) ns
+  std::array<std::uint64_t, kLatencyBuckets> enqueue_latency_{};
+  std::uint64_t bytes_written_{0};
+  std::uint64_t flushes_{0};
+  std::chrono::nanoseconds flush_time_{0};
+  std::uint64_t rotations_{0};
+  std::chrono::nanoseconds rotation_time_{0};
+  // scans of the month directory for the next file index
+  std::uint64_t index_scans_{0};
+  std::chrono::nanoseconds index_scan_time_{0};
+
+  // The upper bound of the bucket holding the per_mille-th timed enqueue
+  std::chrono::nanoseconds enqueue_latency(unsigned per_mille) const;
+  // Write rate since an earlier snapshot of the same sink
+  double bytes_per_second(SinkStats const& earlier) const;
+};
+
+namespace detail {
+class record_queue {
+ public:
+  virtual ~record_queue() = default;
+  virtual void enqueue(boost::log::record_view const& rec) = 0;
+  virtual bool try_enqueue(boost::log::record_view const& rec) = 0;
+  virtual bool try_dequeue(boost::log::record_view& rec) = 0;
+  virtual bool try_dequeue_ready(boost::log::record_view& rec) {
+    return try_dequeue(rec);
+  }
+  // Returns false when interrupted or when nothing was ready by the deadline
+  virtual bool dequeue_ready(
+      boost::log::record_view& rec,
+      std::chrono::steady_clock::time_point deadline) = 0;
+  virtual void interrupt_dequeue() = 0;
+  // Discards the oldest record to make room, false when the queue cannot
+  virtual bool drop_oldest() { return false; }
+  // The queue, or the calling thread's buffer, is three quarters full
+  virtual bool nearly_full() { return false; }
+};
+
+std::unique_ptr<record_queue> make_record_queue(QueueOptions const& options);
+
+// The live counters behind SinkStats, shared by the queue and the backend of
+// a sink. Producers add to the counters of their shard and to dropped_; the
+// other counters have the sink thread as their only writer and are updated
+// with a relaxed load and store.
+struct sink_telemetry {
+  // a thread always uses the same shard, producers only share the cache
+  // line of a shard when there are more than kShards of them
+  static constexpr std::size_t kShards = 16;
+  struct alignas(64) producer_counters {
+    std::atomic<std::uint64_t> enqueued_{0};
+    std::atomic<std::uint64_t> filtered_{0};
+    std::array<std::atomic<std::uint64_t>, SinkStats::kLatencyBuckets>
+        enqueue_latency_{};
+  };
+  std::array<producer_counters, kShards> producers_;
+  alignas(64) std::atomic<std::uint64_t> dropped_{0};
+  alignas(64) std::atomic<std::uint64_t> dequeued_{0};
+  std::atomic<std::uint64_t> high_water_{0};
+  std::atomic<std::uint64_t> written_{0};
+  std::atomic<std::uint64_t> bytes_{0};
+  std::atomic<std::uint64_t> flushes_{0};
+  std::atomic<std::uint64_t> flush_ns_{0};
+  std::atomic<std::uint64_t> rotations_{0};
+  std::atomic<std::uint64_t> rotation_ns_{0};
+  std::atomic<std::uint64_t> index_scans_{0};
+  std::atomic<std::uint64_t> index_scan_ns_{0};
+
+  // for the counters with a single writer
+  static void add(std::atomic<std::uint64_t>& counter, std::uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value,
+                  std::memory_order_relaxed);
+  }
+  static std::size_t thread_shard();
+  producer_counters& this_thread_counters() {
+    return producers_[thread_shard()];
+  }
+  // the sum of the shards
+  std::uint64_t enqueued() const;
+  void record_enqueue_latency(std::chrono::nanoseconds latency);
+  SinkStats snapshot() const;
+};
+
+// Times a rare backend operation (flush, rotation, index scan) into a pair
+// of sink_telemetry counters, nothing without telemetry
+class telemetry_timer {
+ public:
+  using counter = std::atomic<std::uint64_t> sink_telemetry::*;
+
+  telemetry_timer(sink_telemetry* telemetry, counter count, counter ns)
+      : telemetry_(telemetry), count_(count), ns_(ns) {
+    if (telemetry_) start_ = std::chrono::steady_clock::now();
+  }
+  ~telemetry_timer() {
+    if (!telemetry_) return;
+    sink_telemetry::add(telemetry_->*count_, 1);
+    sink_telemetry::add(
+        telemetry_->*ns_,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_)
+            .count());
+  }
+  telemetry_timer(telemetry_timer const&) = delete;
+  telemetry_timer& operator=(telemetry_timer const&) = delete;
+
+ private:
+  sink_telemetry* telemetry_;
+  counter count_;
+  counter ns_;
+  std::chrono::steady_clock::time_point start_;
+};
+}  // namespace detail
+
+// Queueing strategy of boost::log::sinks::asynchronous_sink which picks the
+// record_queue implementation at run time from the queue_options keyword
+class cilog_queue {
+ private:
+  std::unique_ptr<detail::record_queue> queue_;
+  std::mutex idle_mutex_;
+  std::chrono::milliseconds idle_interval_{0};
+  std::function<void()> idle_handler_;
+
+  // overflow policy, see QueueOptions::overflow_
+  bool bounded_{false};
+  int overflow_{QueueOptions::block};
+  std::chrono::milliseconds block_timeout_{0};
+  int drop_severity_{0};
+  std::atomic<std::uint64_t> dropped_{0};
+  std::function<void(std::uint64_t)> drop_handler_;
+  std::shared_ptr<detail::sink_telemetry> telemetry_;
+  // sink thread only
+  std::chrono::steady_clock::time_point next_drop_notice_;
+
+  // boost::parameter only returns a default given as an lvalue correctly
+  static QueueOptions const& default_options() {
+    static const QueueOptions options;
+    return options;
+  }
+
+ protected:
+  cilog_queue() : cilog_queue(QueueOptions()) {}
+  template <typename ArgsT>
+  explicit cilog_queue(ArgsT const& args)
+      : cilog_queue(args[keywords::queue_options | default_options()]) {}
+  explicit cilog_queue(QueueOptions const& options);
+
+  void enqueue(boost::log::record_view const& rec) {
+    telemetry_->this_thread_counters().enqueued_.fetch_add(
+        1, std::memory_order_relaxed);
+    if (!sample_enqueue()) return enqueue_record(rec);
+    auto start = std::chrono::steady_clock::now();
+    enqueue_record(rec);
+    telemetry_->record_enqueue_latency(std::chrono::steady_clock::now() -
+                                       start);
+  }
+  // The core offers a record to every sink with try_enqueue first and only
+  // blocks in enqueue for the ones that turned it down
+  bool try_enqueue(boost::log::record_view const& rec) {
+    if (!sample_enqueue()) {
+      if (!queue_->try_enqueue(rec)) return false;
+    } else {
+      auto start = std::chrono::steady_clock::now();
+      if (!queue_->try_enqueue(rec)) return false;
+      telemetry_->record_enqueue_latency(std::chrono::steady_clock::now() -
+                                         start);
+    }
+    telemetry_->this_thread_counters().enqueued_.fetch_add(
+        1, std::memory_order_relaxed);
+    return true;
+  }
+  bool try_dequeue_ready(boost::log::record_view& rec) {
+    bool dequeued = queue_->try_dequeue_ready(rec);
+    if (dequeued) count_dequeued();
+    if (dropped_.load(std::memory_order_relaxed) != 0) notify_dropped(false);
+    return dequeued;
+  }
+  bool try_dequeue(boost::log::record_view& rec) {
+    bool dequeued = queue_->try_dequeue(rec);
+    if (dequeued) count_dequeued();
+    if (dropped_.load(std::memory_order_relaxed) != 0) {
+      notify_dropped(!dequeued);
+    }
+    return dequeued;
+  }
+  bool dequeue_ready(boost::log::record_view& rec);
+  void interrupt_dequeue() { queue_->interrupt_dequeue(); }
+
+ private:
+  void enqueue_record(boost::log::record_view const& rec) {
+    if (overflow_ == QueueOptions::block && block_timeout_.count() == 0) {
+      queue_->enqueue(rec);
+    } else {
+      enqueue_bounded(rec);
+    }
+  }
+  // true for the first and then every 64th enqueue of the calling thread
+  static bool sample_enqueue() {
+    thread_local unsigned calls = 0;
+    return (calls++ & 63) == 0;
+  }
+  void enqueue_bounded(boost::log::record_view const& rec);
+  // Sink thread side of the queue depth, the shards are only read every
+  // 64 records
+  void count_dequeued() {
+    auto dequeued = telemetry_->dequeued_.load(std::memory_order_relaxed) + 1;
+    telemetry_->dequeued_.store(dequeued, std::memory_order_relaxed);
+    if ((dequeued & 63) != 1) return;
+    auto depth = telemetry_->enqueued() -
+                 telemetry_->dropped_.load(std::memory_order_relaxed) -
+                 dequeued + 1;
+    if (depth > telemetry_->high_water_.load(std::memory_order_relaxed) &&
+        depth < (std::uint64_t(1) << 63)) {
+      telemetry_->high_water_.store(depth, std::memory_order_relaxed);
+    }
+  }
+  void count_dropped();
+  // Passes the records dropped since the last call to the drop handler, on
+  // the sink thread at most once a second or when the queue is drained
+  void notify_dropped(bool drained);
+
+ public:
+  // The handler is run on the sink thread, outside of the backend lock,
+  // whenever the queue has no ready record and then every interval (if not
+  // zero) while no record arrives. The backends use it to write out a batch
+  // and to flush by timer while the application is not logging.
+  void set_idle_handler(std::chrono::milliseconds interval,
+                        std::function<void()> handler);
+  // The handler is run on the sink thread with the number of records dropped
+  // by the overflow policy, the backends write it as a line of the log
+  void set_drop_handler(std::function<void(std::uint64_t)> handler);
+  // Records dropped by the overflow policy since the sink was created
+  std::uint64_t dropped_records() const {
+    return telemetry_->dropped_.load(std::memory_order_relaxed);
+  }
+  // Reads the counters without a lock, see SinkStats
+  SinkStats stats() const { return telemetry_->snapshot(); }
+  // The counters themselves, init_* give them to the backend and the filter
+  std::shared_ptr<detail::sink_telemetry> const& telemetry() const {
+    return telemetry_;
+  }
+};
+
+}  // namespace logger
+}  // namespace castis
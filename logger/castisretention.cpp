@@ -0,0 +1,189 @@
+#include "logger/castisretention.h"
+
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace castis {
+namespace logger {
+namespace {
+// "example" of 2014-08-12[1]_example.log or 2014-08-12[1]_example.log.gz,
+// empty for any other file
+std::string log_file_suffix(std::string_view filename) {
+  if (filename.empty() || filename.front() == '.') return {};
+  for (std::string_view extension : {".log", ".log.gz"}) {
+    if (filename.size() > extension.size() &&
+        filename.substr(filename.size() - extension.size()) == extension) {
+      auto stem = filename.substr(0, filename.size() - extension.size());
+      auto separator = stem.find('_');
+      if (separator == std::string_view::npos) return {};
+      return std::string(stem.substr(separator + 1));
+    }
+  }
+  return {};
+}
+}  // namespace
+
+retention_manager::retention_manager(std::filesystem::path const& target_path,
+                                     RetentionPolicy const& policy)
+    : target_path_(target_path), policy_(policy) {
+  worker_ = std::thread(&retention_manager::run, this);
+}
+
+retention_manager::~retention_manager() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  worker_.join();
+}
+
+void retention_manager::track(std::filesystem::path const& path) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.push_back({path, {}});
+  }
+  cond_.notify_one();
+}
+
+void retention_manager::replace(std::filesystem::path const& original,
+                                std::filesystem::path const& replacement) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.push_back({replacement, original});
+  }
+  cond_.notify_one();
+}
+
+void retention_manager::wait_idle() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_cond_.wait(lock, [this] { return events_.empty() && !busy_; });
+}
+
+void retention_manager::run() {
+  scan();
+  enforce();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    busy_ = false;
+    idle_cond_.notify_all();
+    if (policy_.max_age_.count() > 0) {
+      cond_.wait_for(lock, policy_.check_interval_,
+                     [this] { return stopping_ || !events_.empty(); });
+    } else {
+      cond_.wait(lock, [this] { return stopping_ || !events_.empty(); });
+    }
+    if (stopping_) return;
+    busy_ = true;
+    auto events = std::move(events_);
+    events_.clear();
+    lock.unlock();
+    for (auto const& event : events) {
+      if (!event.replaced_.empty()) forget(event.replaced_);
+      add(event.path_);
+    }
+    enforce();
+    lock.lock();
+  }
+}
+
+// The newest file of each suffix is left out as the one still being written
+void retention_manager::scan() {
+  struct found {
+    fs::path path_;
+    fs::file_time_type time_;
+    std::string suffix_;
+  };
+  std::vector<found> files;
+  std::unordered_map<std::string, fs::file_time_type> newest;
+  std::error_code ec;
+  for (fs::recursive_directory_iterator
+           it(target_path_, fs::directory_options::skip_permission_denied,
+              ec),
+       end;
+       !ec && it != end; it.increment(ec)) {
+    if (it->is_symlink(ec) || !it->is_regular_file(ec)) continue;
+    auto suffix = log_file_suffix(it->path().filename().native());
+    if (suffix.empty()) continue;
+    auto time = it->last_write_time(ec);
+    if (ec) continue;
+    auto& latest = newest.try_emplace(suffix, time).first->second;
+    if (latest < time) latest = time;
+    files.push_back({it->path(), time, std::move(suffix)});
+  }
+  for (auto const& file : files) {
+    if (file.time_ != newest[file.suffix_]) add(file.path_);
+  }
+}
+
+void retention_manager::add(std::filesystem::path const& path) {
+  forget(path);
+  auto suffix = log_file_suffix(path.filename().native());
+  std::error_code ec;
+  auto size = fs::file_size(path, ec);
+  if (ec || suffix.empty()) return;
+  auto time = fs::last_write_time(path, ec);
+  if (ec) return;
+  auto age = by_age_.emplace(time, path);
+  files_.emplace(path.native(), file_entry{size, suffix, age});
+  ++file_counts_[suffix];
+  total_bytes_ += size;
+}
+
+void retention_manager::forget(std::filesystem::path const& path) {
+  auto it = files_.find(path.native());
+  if (it == files_.end()) return;
+  auto& entry = it->second;
+  total_bytes_ -= entry.size_;
+  --file_counts_[entry.suffix_];
+  by_age_.erase(entry.age_);
+  files_.erase(it);
+}
+
+retention_manager::age_index::iterator retention_manager::remove(
+    age_index::iterator it) {
+  auto path = it->second;
+  ++it;
+  std::error_code ec;
+  fs::remove(path, ec);
+  // forgotten even if it could not be removed, so it is not retried forever
+  forget(path);
+  return it;
+}
+
+// Oldest files first, one at a time against the running totals
+void retention_manager::enforce() {
+  auto now = fs::file_time_type::clock::now();
+  while (!by_age_.empty()) {
+    auto oldest = by_age_.begin();
+    bool over_size =
+        policy_.max_bytes_ > 0 && total_bytes_.load() > policy_.max_bytes_;
+    bool too_old = policy_.max_age_.count() > 0 &&
+                   oldest->first + policy_.max_age_ < now;
+    if (!over_size && !too_old) break;
+    remove(oldest);
+  }
+
+  if (policy_.max_files_ == 0) return;
+  bool over_count = false;
+  for (auto const& [suffix, count] : file_counts_) {
+    if (count > policy_.max_files_) over_count = true;
+  }
+  if (!over_count) return;
+  for (auto it = by_age_.begin(); it != by_age_.end();) {
+    auto const& suffix = files_.at(it->second.native()).suffix_;
+    if (file_counts_[suffix] > policy_.max_files_) {
+      it = remove(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+}  // namespace logger
+}  // namespace castis
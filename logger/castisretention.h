@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <boost/smart_ptr/shared_ptr.hpp>
+
+#include "logger/castiscompress.h"
+
+namespace castis {
+namespace logger {
+
+// Limits on the rotated files under a log target directory, 0 disables a
+// limit. The file currently written by a backend is never counted or removed.
+struct RetentionPolicy {
+  RetentionPolicy(std::uintmax_t max_bytes = 0) : max_bytes_(max_bytes) {}
+
+  std::uintmax_t max_bytes_{0};
+  std::chrono::seconds max_age_{0};
+  // per file name suffix, e.g. "example" of 2014-08-12[1]_example.log
+  std::size_t max_files_{0};
+  // how often max_age_ is checked while no file is rotated
+  std::chrono::seconds check_interval_{60};
+};
+
+// Deletes the oldest rotated files of a target directory on a background
+// thread. The directory is scanned once when the manager starts, afterwards
+// the running total is kept from the rotation and compression events so
+// enforcing the limits never walks the tree or blocks a sink thread.
+class retention_manager {
+ public:
+  retention_manager(std::filesystem::path const& target_path,
+                    RetentionPolicy const& policy);
+  ~retention_manager();
+  retention_manager(retention_manager const&) = delete;
+  retention_manager& operator=(retention_manager const&) = delete;
+
+  // A file the backend will not write again
+  void track(std::filesystem::path const& path);
+  // A tracked file was replaced, e.g. by its compressed copy
+  void replace(std::filesystem::path const& original,
+               std::filesystem::path const& replacement);
+  // Blocks until the initial scan and every queued event are applied
+  void wait_idle();
+
+  std::uintmax_t total_bytes() const { return total_bytes_.load(); }
+
+ private:
+  using age_index = std::multimap<std::filesystem::file_time_type,
+                                  std::filesystem::path>;
+  struct file_entry {
+    std::uintmax_t size_;
+    std::string suffix_;
+    age_index::iterator age_;
+  };
+  struct event {
+    std::filesystem::path path_;
+    std::filesystem::path replaced_;
+  };
+
+  void run();
+  void scan();
+  void add(std::filesystem::path const& path);
+  void forget(std::filesystem::path const& path);
+  age_index::iterator remove(age_index::iterator it);
+  void enforce();
+
+  const std::filesystem::path target_path_;
+  const RetentionPolicy policy_;
+
+  // owned by the background thread
+  age_index by_age_;
+  std::unordered_map<std::string, file_entry> files_;
+  std::unordered_map<std::string, std::size_t> file_counts_;
+  std::atomic<std::uintmax_t> total_bytes_{0};
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::condition_variable idle_cond_;
+  std::deque<event> events_;
+  bool busy_{true};
+  bool stopping_{false};
+  std::thread worker_;
+};
+
+// Tracks the files the sink's backend rotates out, and their compressed
+// copies when a compressor is given (use instead of compress_rotated_files)
+template <typename SinkT>
+void retain_rotated_files(boost::shared_ptr<SinkT> const& sink,
+                          std::shared_ptr<retention_manager> manager,
+                          std::shared_ptr<log_compressor> compressor = {}) {
+  sink->locked_backend()->set_rotated_file_handler(
+      [manager, compressor](std::filesystem::path const& path) {
+        manager->track(path);
+        if (!compressor) return;
+        compressor->enqueue(
+            path, [manager](std::filesystem::path const& original,
+                            std::filesystem::path const& compressed) {
+              manager->replace(original, compressed);
+            });
+      });
+}
+
+}  // namespace logger
+}  // namespace castis
@@ -0,0 +1,73 @@
+#include "logger/castistelemetry.h"
+
+#include <utility>
+
+namespace castis {
+namespace logger {
+
+std::string format_sink_stats(std::string_view name, SinkStats const& stats,
+                              SinkStats const& earlier) {
+  auto us = [](std::chrono::nanoseconds duration) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration)
+        .count();
+  };
+  return fmt::format(
+      "sink={} enqueued={} written={} filtered={} dropped={} depth={} "
+      "high_water={} enqueue_p50={}ns enqueue_p99={}ns bytes_per_sec={:.0f} "
+      "flushes={} flush_us={} rotations={} rotation_us={} index_scans={} "
+      "index_scan_us={}",
+      name, stats.records_enqueued_, stats.records_written_,
+      stats.records_filtered_, stats.records_dropped_, stats.queue_depth_,
+      stats.queue_high_water_, stats.enqueue_latency(500).count(),
+      stats.enqueue_latency(990).count(), stats.bytes_per_second(earlier),
+      stats.flushes_, us(stats.flush_time_), stats.rotations_,
+      us(stats.rotation_time_), stats.index_scans_,
+      us(stats.index_scan_time_));
+}
+
+stats_reporter::stats_reporter(std::chrono::seconds interval)
+    : interval_(interval) {
+  if (interval_.count() > 0) worker_ = std::thread(&stats_reporter::run, this);
+}
+
+stats_reporter::~stats_reporter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  if (worker_.joinable()) worker_.join();
+}
+
+void stats_reporter::add_telemetry(
+    std::string name, std::shared_ptr<detail::sink_telemetry> telemetry) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto last = telemetry->snapshot();
+  entries_.push_back({std::move(name), std::move(telemetry), last});
+}
+
+void stats_reporter::report() {
+  std::vector<std::string> lines;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : entries_) {
+      auto stats = entry.telemetry_->snapshot();
+      lines.push_back(format_sink_stats(entry.name_, stats, entry.last_));
+      entry.last_ = stats;
+    }
+  }
+  // logged outside the lock, a reported sink can be the one writing these
+  for (auto const& line : lines) CIMLOG(cilog_stats, info, "{}", line);
+}
+
+void stats_reporter::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!cond_.wait_for(lock, interval_, [this] { return stopping_; })) {
+    lock.unlock();
+    report();
+    lock.lock();
+  }
+}
+
+}  // namespace logger
+}  // namespace castis
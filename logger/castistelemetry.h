@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "castislogger.h"
+
+namespace castis {
+namespace logger {
+
+// "sink=<name> enqueued=N written=N filtered=N dropped=N depth=N
+// high_water=N enqueue_p50=Nns enqueue_p99=Nns bytes_per_sec=N flushes=N
+// flush_us=N rotations=N rotation_us=N index_scans=N index_scan_us=N", the
+// rate is the one since earlier
+std::string format_sink_stats(std::string_view name, SinkStats const& stats,
+                              SinkStats const& earlier);
+
+// Logs the SinkStats of the added sinks every interval as
+// CIMLOG(cilog_stats, info) records on kStatsChannel. Only a module logger
+// with the "cilog_stats" module writes them, unnamed modules do not.
+class stats_reporter {
+ public:
+  explicit stats_reporter(
+      std::chrono::seconds interval = std::chrono::seconds(60));
+  ~stats_reporter();
+  stats_reporter(stats_reporter const&) = delete;
+  stats_reporter& operator=(stats_reporter const&) = delete;
+
+  // The counters of the sink are kept after it stops
+  template <typename SinkT>
+  void add(std::string name, boost::shared_ptr<SinkT> const& sink) {
+    add_telemetry(std::move(name), sink->telemetry());
+  }
+  // Logs a record for every sink now
+  void report();
+
+ private:
+  struct entry {
+    std::string name_;
+    std::shared_ptr<detail::sink_telemetry> telemetry_;
+    SinkStats last_;
+  };
+
+  void add_telemetry(std::string name,
+                     std::shared_ptr<detail::sink_telemetry> telemetry);
+  void run();
+
+  const std::chrono::seconds interval_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stopping_{false};
+  std::vector<entry> entries_;
+  std::thread worker_;
+};
+
+}  // namespace logger
+}  // namespace castis
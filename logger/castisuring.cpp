@@ -0,0 +1,378 @@
+#include "logger/castislogger.h"
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+namespace castis {
+namespace logger {
+namespace detail {
+namespace {
+// user_data of the fdatasync entries, writes carry their buffer index
+constexpr std::uint64_t kSyncTag = ~std::uint64_t{0};
+
+int io_uring_setup(unsigned entries, io_uring_params* params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                  min_complete, flags, nullptr, 0));
+}
+
+int io_uring_register(int fd, unsigned opcode, void const* arg,
+                      unsigned nr_args) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+template <typename T>
+T* ring_field(void* base, std::uint32_t offset) {
+  return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+}  // namespace
+
+struct uring_file::ring {
+  // set up the ring and the buffers, nullptr when io_uring is not usable
+  static std::unique_ptr<ring> create();
+  ~ring();
+
+  io_uring_sqe* next_sqe();
+  // Submits the queued entries and waits for min_complete completions
+  bool enter(unsigned min_complete);
+  void reap();
+  // Queues the current buffer as a write, followed by an fdatasync of
+  // everything written so far if asked. A sync asked for while another one
+  // is in flight is queued by the next call or by drain.
+  void submit_current(bool sync);
+  // Makes a free buffer current, waiting for a write if all are in flight
+  void next_buffer();
+  void drain();
+
+  int ring_fd_{-1};
+  void* sq_map_{MAP_FAILED};
+  std::size_t sq_map_size_{0};
+  void* cq_map_{MAP_FAILED};
+  std::size_t cq_map_size_{0};
+  io_uring_sqe* sqes_{static_cast<io_uring_sqe*>(MAP_FAILED)};
+  std::size_t sqes_size_{0};
+
+  std::atomic<unsigned>* sq_head_{nullptr};
+  std::atomic<unsigned>* sq_tail_{nullptr};
+  unsigned sq_mask_{0};
+  unsigned sq_entries_{0};
+  unsigned* sq_array_{nullptr};
+  unsigned sq_queued_{0};
+  std::atomic<unsigned>* cq_head_{nullptr};
+  std::atomic<unsigned>* cq_tail_{nullptr};
+  unsigned cq_mask_{0};
+  io_uring_cqe* cqes_{nullptr};
+
+  bool fixed_buffers_{false};
+  bool fixed_file_{false};
+  char* buffers_{nullptr};
+  bool in_flight_[kBuffers]{};
+  std::size_t lengths_[kBuffers]{};
+  unsigned in_flight_count_{0};
+  unsigned current_{0};
+  std::size_t current_size_{0};
+  bool sync_in_flight_{false};
+  bool sync_wanted_{false};
+
+  int fd_{-1};
+  bool good_{true};
+  uintmax_t opened_size_{0};
+  uintmax_t offset_{0};
+};
+
+std::unique_ptr<uring_file::ring> uring_file::ring::create() {
+  auto r = std::make_unique<ring>();
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  r->ring_fd_ = io_uring_setup(kBuffers * 2 + 2, &params);
+  if (r->ring_fd_ < 0) return nullptr;
+
+  r->sq_map_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  r->cq_map_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_map) {
+    r->sq_map_size_ = r->cq_map_size_ =
+        std::max(r->sq_map_size_, r->cq_map_size_);
+  }
+  r->sq_map_ = mmap(nullptr, r->sq_map_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->ring_fd_,
+                    IORING_OFF_SQ_RING);
+  if (r->sq_map_ == MAP_FAILED) return nullptr;
+  if (!single_map) {
+    r->cq_map_ =
+        mmap(nullptr, r->cq_map_size_, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, r->ring_fd_, IORING_OFF_CQ_RING);
+    if (r->cq_map_ == MAP_FAILED) return nullptr;
+  }
+  void* cq_base = single_map ? r->sq_map_ : r->cq_map_;
+  r->sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  r->sqes_ = static_cast<io_uring_sqe*>(
+      mmap(nullptr, r->sqes_size_, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, r->ring_fd_, IORING_OFF_SQES));
+  if (r->sqes_ == MAP_FAILED) return nullptr;
+
+  r->sq_head_ = ring_field<std::atomic<unsigned>>(r->sq_map_,
+                                                  params.sq_off.head);
+  r->sq_tail_ = ring_field<std::atomic<unsigned>>(r->sq_map_,
+                                                  params.sq_off.tail);
+  r->sq_mask_ = *ring_field<unsigned>(r->sq_map_, params.sq_off.ring_mask);
+  r->sq_entries_ = params.sq_entries;
+  r->sq_array_ = ring_field<unsigned>(r->sq_map_, params.sq_off.array);
+  r->cq_head_ = ring_field<std::atomic<unsigned>>(cq_base, params.cq_off.head);
+  r->cq_tail_ = ring_field<std::atomic<unsigned>>(cq_base, params.cq_off.tail);
+  r->cq_mask_ = *ring_field<unsigned>(cq_base, params.cq_off.ring_mask);
+  r->cqes_ = ring_field<io_uring_cqe>(cq_base, params.cq_off.cqes);
+
+  void* buffers = nullptr;
+  if (posix_memalign(&buffers, 4096, kBuffers * kBatchSize) != 0) {
+    return nullptr;
+  }
+  r->buffers_ = static_cast<char*>(buffers);
+
+  // Registering needs locked memory (RLIMIT_MEMLOCK) and a 5.5 kernel for
+  // the sparse file table, plain writes of the same buffers work without
+  iovec iovecs[kBuffers];
+  for (unsigned i = 0; i < kBuffers; ++i) {
+    iovecs[i].iov_base = r->buffers_ + i * kBatchSize;
+    iovecs[i].iov_len = kBatchSize;
+  }
+  r->fixed_buffers_ = io_uring_register(r->ring_fd_, IORING_REGISTER_BUFFERS,
+                                        iovecs, kBuffers) == 0;
+  int no_file = -1;
+  r->fixed_file_ =
+      io_uring_register(r->ring_fd_, IORING_REGISTER_FILES, &no_file, 1) == 0;
+  return r;
+}
+
+uring_file::ring::~ring() {
+  if (sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+  if (cq_map_ != MAP_FAILED) munmap(cq_map_, cq_map_size_);
+  if (sq_map_ != MAP_FAILED) munmap(sq_map_, sq_map_size_);
+  if (ring_fd_ >= 0) ::close(ring_fd_);
+  free(buffers_);
+}
+
+io_uring_sqe* uring_file::ring::next_sqe() {
+  auto tail = sq_tail_->load(std::memory_order_relaxed) + sq_queued_;
+  if (tail - sq_head_->load(std::memory_order_acquire) >= sq_entries_) {
+    enter(0);
+    tail = sq_tail_->load(std::memory_order_relaxed);
+  }
+  auto index = tail & sq_mask_;
+  auto* sqe = &sqes_[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  ++sq_queued_;
+  if (fixed_file_) {
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE;
+  } else {
+    sqe->fd = fd_;
+  }
+  return sqe;
+}
+
+bool uring_file::ring::enter(unsigned min_complete) {
+  auto to_submit = sq_queued_;
+  if (to_submit > 0) {
+    sq_tail_->store(sq_tail_->load(std::memory_order_relaxed) + to_submit,
+                    std::memory_order_release);
+    sq_queued_ = 0;
+  }
+  while (to_submit > 0 || min_complete > 0) {
+    int done = io_uring_enter(ring_fd_, to_submit, min_complete,
+                              min_complete ? IORING_ENTER_GETEVENTS : 0);
+    if (done < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    break;
+  }
+  reap();
+  return true;
+}
+
+void uring_file::ring::reap() {
+  auto head = cq_head_->load(std::memory_order_relaxed);
+  auto tail = cq_tail_->load(std::memory_order_acquire);
+  for (; head != tail; ++head) {
+    auto const& cqe = cqes_[head & cq_mask_];
+    if (cqe.user_data == kSyncTag) {
+      sync_in_flight_ = false;
+      continue;
+    }
+    // a failed or short write loses the rest of its batch as write(2) would
+    auto index = static_cast<unsigned>(cqe.user_data);
+    if (cqe.res < 0 || static_cast<std::size_t>(cqe.res) < lengths_[index]) {
+      good_ = false;
+    }
+    in_flight_[index] = false;
+    --in_flight_count_;
+  }
+  cq_head_->store(head, std::memory_order_release);
+}
+
+void uring_file::ring::submit_current(bool sync) {
+  sync_wanted_ = sync_wanted_ || sync;
+  if (current_size_ == 0 && !sync_wanted_) return;
+  bool queue_sync = sync_wanted_ && !sync_in_flight_;
+  if (current_size_ > 0) {
+    auto* sqe = next_sqe();
+    sqe->opcode = fixed_buffers_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->addr = reinterpret_cast<std::uint64_t>(buffers_ +
+                                                current_ * kBatchSize);
+    sqe->len = static_cast<std::uint32_t>(current_size_);
+    sqe->off = offset_;
+    sqe->buf_index = static_cast<std::uint16_t>(current_);
+    sqe->user_data = current_;
+    in_flight_[current_] = true;
+    lengths_[current_] = current_size_;
+    ++in_flight_count_;
+    offset_ += current_size_;
+    current_size_ = 0;
+  }
+  if (queue_sync) {
+    // a link would only order it after the write above, drain waits for
+    // every write submitted before it
+    auto* sqe = next_sqe();
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->flags |= IOSQE_IO_DRAIN;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = kSyncTag;
+    sync_in_flight_ = true;
+    sync_wanted_ = false;
+  }
+  if (!enter(0)) good_ = false;
+  next_buffer();
+}
+
+void uring_file::ring::next_buffer() {
+  if (current_size_ > 0 || !in_flight_[current_]) return;
+  for (;;) {
+    for (unsigned i = 0; i < kBuffers; ++i) {
+      if (!in_flight_[i]) {
+        current_ = i;
+        return;
+      }
+    }
+    if (!enter(1)) {
+      good_ = false;
+      return;
+    }
+  }
+}
+
+void uring_file::ring::drain() {
+  submit_current(false);
+  for (;;) {
+    while (in_flight_count_ > 0 || sync_in_flight_) {
+      if (!enter(1)) {
+        good_ = false;
+        return;
+      }
+    }
+    if (!sync_wanted_) return;
+    // asked for while the previous sync was in flight
+    submit_current(false);
+  }
+}
+
+uring_file::uring_file() : ring_(ring::create()) {}
+
+uring_file::~uring_file() { close(); }
+
+bool uring_file::open(std::filesystem::path const& path,
+                      uintmax_t expected_size) {
+  if (!ring_) return fallback_.open(path, expected_size);
+  close();
+  auto& r = *ring_;
+  r.fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (r.fd_ < 0) return false;
+  struct stat st;
+  r.opened_size_ = (::fstat(r.fd_, &st) == 0)
+                       ? static_cast<uintmax_t>(st.st_size)
+                       : 0;
+  r.offset_ = r.opened_size_;
+  r.good_ = true;
+  if (r.fixed_file_) {
+    io_uring_files_update update;
+    std::memset(&update, 0, sizeof(update));
+    update.fds = reinterpret_cast<std::uint64_t>(&r.fd_);
+    if (io_uring_register(r.ring_fd_, IORING_REGISTER_FILES_UPDATE, &update,
+                          1) != 1) {
+      r.fixed_file_ = false;
+    }
+  }
+  return true;
+}
+
+void uring_file::close() {
+  if (!ring_) return fallback_.close();
+  auto& r = *ring_;
+  if (r.fd_ < 0) return;
+  r.drain();
+  if (r.fixed_file_) {
+    int no_file = -1;
+    io_uring_files_update update;
+    std::memset(&update, 0, sizeof(update));
+    update.fds = reinterpret_cast<std::uint64_t>(&no_file);
+    io_uring_register(r.ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1);
+  }
+  ::close(r.fd_);
+  r.fd_ = -1;
+}
+
+bool uring_file::is_open() const {
+  return ring_ ? ring_->fd_ >= 0 : fallback_.is_open();
+}
+
+bool uring_file::good() const {
+  return ring_ ? ring_->good_ : fallback_.good();
+}
+
+uintmax_t uring_file::opened_size() const {
+  return ring_ ? ring_->opened_size_ : fallback_.opened_size();
+}
+
+void uring_file::append(std::string_view line) {
+  if (!ring_) return fallback_.append(line);
+  auto& r = *ring_;
+  if (r.fd_ < 0) return;
+  // a line longer than a buffer is written in pieces
+  while (!line.empty()) {
+    if (r.current_size_ == kBatchSize) r.submit_current(false);
+    auto size = std::min(line.size(), kBatchSize - r.current_size_);
+    std::memcpy(r.buffers_ + r.current_ * kBatchSize + r.current_size_,
+                line.data(), size);
+    r.current_size_ += size;
+    line.remove_prefix(size);
+  }
+  if (r.current_size_ == kBatchSize) r.submit_current(false);
+  r.buffers_[r.current_ * kBatchSize + r.current_size_++] = '\n';
+}
+
+void uring_file::write_pending() {
+  if (!ring_) return fallback_.write_pending();
+  if (ring_->fd_ >= 0) ring_->submit_current(sync_);
+}
+
+}  // namespace detail
+}  // namespace logger
+}  // namespace castis
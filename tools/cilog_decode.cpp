@@ -0,0 +1,31 @@
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#include "logger/castisbinlog.h"
+
+// Expands the .clog files written by a binary_logger into the text lines the
+// file sinks write, in the order given:
+//   cilog-decode log/2014-08/2014-08-13_example.clog > example.log
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::fprintf(stderr, "usage: %s FILE.clog...\n", argv[0]);
+    return 2;
+  }
+  std::ios::sync_with_stdio(false);
+  int status = 0;
+  for (int i = 1; i < argc; ++i) {
+    std::ifstream in(argv[i], std::ios::binary);
+    if (!in.is_open()) {
+      std::fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[i]);
+      status = 1;
+      continue;
+    }
+    if (!castis::logger::decode_binary_log(in, std::cout)) {
+      std::fprintf(stderr, "%s: %s is not a binary log or is truncated\n",
+                   argv[0], argv[i]);
+      status = 1;
+    }
+  }
+  return status;
+}
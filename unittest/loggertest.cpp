@@ -1,9 +1,42 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <new>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 #include <boost/date_time.hpp>
+#include <boost/log/attributes/constant.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/sinks/sync_frontend.hpp>
+#include <boost/log/sinks/text_ostream_backend.hpp>
+#include <zlib.h>
 
+#include "fmt/chrono.h"
+#include "logger/castisaccesslogger.h"
+#include "logger/castisaccessrollup.h"
+#include "logger/castisbinlog.h"
+#include "logger/castiscompress.h"
 #include "logger/castislogger.h"
+#include "logger/castisretention.h"
+#include "logger/castistelemetry.h"
+
+// counts the allocations made through the global operator new
+std::atomic<std::size_t> allocations{0};
+
+void* operator new(std::size_t size) {
+  ++allocations;
+  if (void* p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
 
 std::string datetime_string_with_format(std::string const& format) {
   std::locale loc(
@@ -15,6 +48,1099 @@ std::string datetime_string_with_format(std::string const& format) {
   return ss.str();
 }
 
+TEST(LoggerTest, per_thread_queue_keeps_line_order) {
+  namespace expr = boost::log::expressions;
+  std::filesystem::remove_all("./log_per_thread");
+  auto run = [](std::string const& name, std::size_t capacity) {
+    castis::logger::QueueOptions queue(
+        capacity, castis::logger::QueueOptions::per_thread);
+    queue.ordering_window_ = std::chrono::milliseconds(200);
+    auto sink = castis::logger::init_async_logger(
+        name, "1.0.0", "./log_per_thread", 1024 * 1024 * 1024, false, queue);
+    sink->set_formatter(expr::stream << expr::attr<unsigned int>("LineID"));
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([] {
+        for (int i = 0; i < 10000; ++i) CILOG(info) << i;
+      });
+    }
+    for (auto& t : threads) t.join();
+    castis::logger::stop_logger(sink);
+
+    std::ifstream file(datetime_string_with_format(
+        "./log_per_thread/%Y-%m/%Y-%m-%d_" + name + ".log"));
+    std::vector<unsigned int> line_ids;
+    for (unsigned int line_id = 0; file >> line_id;) {
+      line_ids.push_back(line_id);
+    }
+    return line_ids;
+  };
+
+  // the buffers never fill up, every record waits out the window
+  auto line_ids = run("per_thread", 16 * 1024);
+  EXPECT_EQ(40000u, line_ids.size());
+  EXPECT_TRUE(std::is_sorted(line_ids.begin(), line_ids.end()));
+
+  // full buffers are drained without waiting for the window, 40000 records
+  // held back 200ms per 256 would take about 8 seconds
+  auto start = std::chrono::steady_clock::now();
+  line_ids = run("per_thread_full", 256);
+  EXPECT_GT(std::chrono::seconds(6), std::chrono::steady_clock::now() - start);
+  EXPECT_EQ(40000u, line_ids.size());
+}
+
+TEST(LoggerTest, ring_queue_keeps_every_line_in_thread_order) {
+  namespace expr = boost::log::expressions;
+  std::filesystem::remove_all("./log_ring");
+  // a small ring keeps the producers wrapping around and waiting on it
+  auto sink = castis::logger::init_async_logger(
+      "ring", "1.0.0", "./log_ring", 1024 * 1024 * 1024, false,
+      castis::logger::QueueOptions(16));
+  sink->set_formatter(expr::stream << expr::smessage);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([t] {
+      for (int i = 0; i < 10000; ++i) CILOG(info) << t << ' ' << i;
+    });
+  }
+  for (auto& t : threads) t.join();
+  castis::logger::stop_logger(sink);
+
+  std::ifstream file(
+      datetime_string_with_format("./log_ring/%Y-%m/%Y-%m-%d_ring.log"));
+  std::array<int, 4> next{};
+  int lines = 0;
+  for (int t, i; file >> t >> i; ++lines) {
+    ASSERT_TRUE(t >= 0 && t < 4);
+    ASSERT_EQ(next[t], i) << "thread " << t;
+    ++next[t];
+  }
+  EXPECT_EQ(40000, lines);
+  for (int t = 0; t < 4; ++t) EXPECT_EQ(10000, next[t]);
+}
+
+TEST(LoggerTest, severity_threshold_skips_disabled_statements) {
+  std::filesystem::remove_all("./log_threshold");
+  auto sink = castis::logger::init_async_level_logger(
+      "threshold", "1.0.0", {info, error}, "threshold", "./log_threshold");
+  castis::logger::set_severity_threshold(warning);
+  int evaluated = 0;
+  CILOG(info) << ++evaluated;
+  EXPECT_EQ(0, evaluated);
+  CILOG(error) << ++evaluated;
+  EXPECT_EQ(1, evaluated);
+
+  castis::logger::set_severity_threshold(foo);
+  CILOG(info) << ++evaluated;
+  EXPECT_EQ(2, evaluated);
+  castis::logger::stop_logger(sink);
+}
+
+TEST(LoggerTest, deferred_format_is_done_by_the_sink_thread) {
+  std::filesystem::remove_all("./log_deferred");
+  castis::logger::QueueOptions queue;
+  queue.deferred_format_ = true;
+  auto sink = castis::logger::init_async_level_logger(
+      "deferred", "1.0.0", {info}, "deferred", "./log_deferred",
+      10 * 1024 * 1024, true, queue);
+
+  // a sink formatting on the calling thread turns deferring off
+  int other_sink = 0;
+  castis::logger::detail::set_sink_threshold(&other_sink, foo);
+  EXPECT_FALSE(castis::logger::detail::deferred_format_active);
+  castis::logger::detail::remove_sink_threshold(&other_sink);
+
+  static const castis::logger::CallSite site("loggertest.cpp", "deferred", 1,
+                                             "", "default");
+  static const castis::logger::FormatSite format_site(site,
+                                                      "{} {:.1f} {:>3} {}");
+  std::string args;
+  castis::logger::detail::encode_args(args, 7, 2.5, std::string("s"), true);
+  castis::logger::detail::push_deferred(format_site, info, std::move(args));
+  // formatted by the caller or deferred, depending on the other sinks
+  CILOG(info, "{} {:.1f} {:>3} {}", 7, 2.5, std::string("s"), true);
+
+  // a sink added to the core directly is not registered and does not turn
+  // deferring off, expr::smessage formats the deferred message for it
+  namespace expr = boost::log::expressions;
+  auto messages = boost::make_shared<std::ostringstream>();
+  auto text_sink = boost::make_shared<boost::log::sinks::synchronous_sink<
+      boost::log::sinks::text_ostream_backend>>();
+  text_sink->locked_backend()->add_stream(messages);
+  text_sink->set_formatter(expr::stream << expr::smessage);
+  boost::log::core::get()->add_sink(text_sink);
+  args.clear();
+  castis::logger::detail::encode_args(args, 7, 2.5, std::string("s"), true);
+  castis::logger::detail::push_deferred(format_site, info, std::move(args));
+  boost::log::core::get()->remove_sink(text_sink);
+  EXPECT_EQ("7 2.5   s true\n", messages->str());
+
+  castis::logger::stop_logger(sink);
+  sink.reset();
+
+  std::ifstream file(datetime_string_with_format(
+      "./log_deferred/%Y-%m/%Y-%m-%d_deferred.log"));
+  std::string line;
+  int lines = 0;
+  while (std::getline(file, line)) {
+    EXPECT_EQ(",,7 2.5   s true",
+              line.substr(line.size() - std::strlen(",,7 2.5   s true")));
+    ++lines;
+  }
+  EXPECT_EQ(3, lines);
+}
+
+TEST(LoggerTest, rate_limited_statements_report_suppressed_ones) {
+  std::filesystem::remove_all("./log_limited");
+  castis::logger::detail::rate_limiter limiter(5);
+  for (int i = 0; i < 5; ++i) EXPECT_EQ(0, limiter.acquire());
+  for (int i = 0; i < 100; ++i) EXPECT_EQ(-1, limiter.acquire());
+  std::this_thread::sleep_for(std::chrono::milliseconds(250));
+  EXPECT_EQ(100, limiter.acquire());
+  EXPECT_EQ(-1, limiter.acquire());
+
+  auto sink = castis::logger::init_async_level_logger(
+      "limited", "1.0.0", {error}, "limited", "./log_limited");
+  auto retry = [](int i) {
+    CILOG_RATE_LIMITED(2, error, "retry {} failed", i);
+    CILOG_RATE_LIMITED(1, error) << "stream " << i;
+  };
+  for (int i = 0; i < 1000; ++i) retry(i);
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  retry(1000);
+  castis::logger::stop_logger(sink);
+  sink.reset();
+
+  std::ifstream file(datetime_string_with_format(
+      "./log_limited/%Y-%m/%Y-%m-%d_limited.log"));
+  std::vector<std::string> messages;
+  for (std::string line; std::getline(file, line);) {
+    messages.push_back(line.substr(line.rfind(",") + 1));
+  }
+  std::vector<std::string> expected = {
+      "retry 0 failed",
+      "stream 0",
+      "retry 1 failed",
+      "(suppressed 998 similar messages) retry 1000 failed",
+      "(suppressed 999 similar messages) stream 1000",
+  };
+  EXPECT_EQ(expected, messages);
+}
+
+TEST(LoggerTest, duplicate_lines_are_collapsed) {
+  std::filesystem::remove_all("./log_dedupe");
+  auto sink = castis::logger::init_async_level_logger(
+      "dedupe", "1.0.0", {error}, "dedupe", "./log_dedupe");
+  sink->locked_backend()->collapse_duplicates(std::chrono::seconds(10));
+  auto poll = [](std::string_view state) {
+    CILOG(error, "polling {}", state);
+  };
+  for (int i = 0; i < 5; ++i) poll("busy");
+  poll("done");
+  for (int i = 0; i < 3; ++i) poll("busy");
+  castis::logger::stop_logger(sink);
+  sink.reset();
+
+  std::ifstream file(datetime_string_with_format(
+      "./log_dedupe/%Y-%m/%Y-%m-%d_dedupe.log"));
+  std::vector<std::string> messages;
+  for (std::string line; std::getline(file, line);) {
+    messages.push_back(line.substr(line.rfind(",") + 1));
+  }
+  std::vector<std::string> expected = {
+      "polling busy", "last message repeated 4 times",
+      "polling done", "polling busy",
+      "last message repeated 2 times",
+  };
+  EXPECT_EQ(expected, messages);
+
+  // a run held back for max_delay is written and collapsing goes on
+  castis::logger::detail::duplicate_collapser collapser;
+  collapser.enable(std::chrono::seconds(1));
+  auto now = std::chrono::steady_clock::now();
+  std::string line = "a,1,2018-09-05,16:48:09.1,Error,f::g:1:7,,message";
+  EXPECT_FALSE(collapser.repeated(line, now));
+  line.replace(line.find("09.1"), 4, "09.2");
+  EXPECT_TRUE(collapser.repeated(line, now));
+  EXPECT_FALSE(collapser.due(now));
+  EXPECT_TRUE(collapser.due(now + std::chrono::seconds(1)));
+  std::string repeats;
+  EXPECT_TRUE(collapser.take_repeats(repeats));
+  EXPECT_EQ(
+      "a,1,2018-09-05,16:48:09.2,Error,f::g:1:7,,last message repeated 1 "
+      "times",
+      repeats);
+  EXPECT_FALSE(collapser.take_repeats(repeats));
+  EXPECT_TRUE(collapser.repeated(line, now));
+}
+
+TEST(LoggerTest, full_queue_follows_overflow_policy) {
+  std::filesystem::remove_all("./log_overflow");
+  auto run = [](std::string const& name, castis::logger::QueueOptions queue,
+                int records) {
+    auto sink = castis::logger::init_async_level_logger(
+        name, "1.0.0", {info, error}, name, "./log_overflow",
+        10 * 1024 * 1024, true, queue);
+    {
+      // the sink thread waits for the backend while the queue fills up
+      auto backend = sink->locked_backend();
+      for (int i = 0; i < records; ++i) {
+        CILOG(i % 2 ? error : info, "record {}", i);
+      }
+    }
+    auto dropped = sink->dropped_records();
+    castis::logger::stop_logger(sink);
+    std::ifstream file(datetime_string_with_format(
+        "./log_overflow/%Y-%m/%Y-%m-%d_" + name + ".log"));
+    // the notices are written as the sink thread gets to them
+    std::vector<std::string> messages;
+    std::uint64_t noticed = 0;
+    for (std::string line; std::getline(file, line);) {
+      auto message = line.substr(line.rfind(",") + 1);
+      if (message.find("dropped ") == 0) {
+        noticed += std::stoull(message.substr(std::strlen("dropped ")));
+      } else {
+        messages.push_back(message);
+      }
+    }
+    EXPECT_LT(0, dropped);
+    EXPECT_EQ(dropped, noticed);
+    EXPECT_EQ(records, messages.size() + dropped);
+    return messages;
+  };
+
+  castis::logger::QueueOptions queue(4);
+  queue.overflow_ = castis::logger::QueueOptions::drop_newest;
+  auto messages = run("drop_newest", queue, 100);
+  ASSERT_FALSE(messages.empty());
+  EXPECT_EQ("record 0", messages.front());
+  EXPECT_GE(5, messages.size());
+
+  queue.overflow_ = castis::logger::QueueOptions::drop_oldest;
+  messages = run("drop_oldest", queue, 100);
+  ASSERT_FALSE(messages.empty());
+  EXPECT_EQ("record 99", messages.back());
+  EXPECT_GE(5, messages.size());
+
+  queue.overflow_ = castis::logger::QueueOptions::drop_below_severity;
+  queue.drop_severity_ = error;
+  queue.block_timeout_ = std::chrono::milliseconds(1);
+  messages = run("drop_below", queue, 20);
+  for (auto const& message : messages) {
+    auto i = std::stoi(message.substr(std::strlen("record ")));
+    // info records are dropped from three quarters full on
+    EXPECT_TRUE(i < 4 || i % 2 == 1) << message;
+  }
+
+  queue.overflow_ = castis::logger::QueueOptions::block;
+  run("block", queue, 10);
+}
+
+TEST(LoggerTest, sink_stats_count_the_records_of_a_sink) {
+  std::filesystem::remove_all("./log_sink_stats");
+  auto sink = castis::logger::init_async_level_logger(
+      "sink_stats", "1.0.0", {info, error}, "sink_stats", "./log_sink_stats",
+      1024, true);
+  auto reporter_sink = castis::logger::init_async_module_logger(
+      "sink_stats", "1.0.0", {{"cilog_stats", info}}, "sink_stats_report",
+      "./log_sink_stats");
+  castis::logger::stats_reporter reporter(std::chrono::seconds(0));
+  reporter.add("sink_stats", sink);
+  for (int i = 0; i < 100; ++i) {
+    CILOG(i % 10 ? info : warning, "record {}", i);
+  }
+  sink->flush();
+
+  auto stats = sink->stats();
+  // the filtered records never reach the queue
+  EXPECT_EQ(90, stats.records_enqueued_);
+  EXPECT_EQ(90, stats.records_written_);
+  EXPECT_EQ(10, stats.records_filtered_);
+  EXPECT_EQ(0, stats.records_dropped_);
+  EXPECT_EQ(0, stats.queue_depth_);
+  EXPECT_LE(1, stats.queue_high_water_);
+  EXPECT_LT(90 * std::strlen("record 0"), stats.bytes_written_);
+  EXPECT_LT(0, stats.flushes_);
+  // every line is 80 bytes or so, a kilobyte file takes a dozen of them
+  EXPECT_LT(0, stats.rotations_);
+  EXPECT_LT(0, stats.index_scans_);
+  // the first enqueue of a thread is timed
+  EXPECT_LT(0, stats.enqueue_latency(990).count());
+
+  reporter.report();
+  castis::logger::stop_logger(reporter_sink);
+  castis::logger::stop_logger(sink);
+  std::ifstream file(datetime_string_with_format(
+      "./log_sink_stats/%Y-%m/%Y-%m-%d_sink_stats_report.log"));
+  std::string line;
+  ASSERT_TRUE(std::getline(file, line));
+  EXPECT_NE(std::string::npos,
+            line.find(",cilog_stats,sink=sink_stats enqueued=90 written=90 "
+                      "filtered=10 dropped=0 depth=0 "))
+      << line;
+}
+
+TEST(LoggerTest, message_formatting_does_not_allocate) {
+  std::string message;
+  message.reserve(256);
+  boost::log::formatting_ostream strm(message);
+  std::string encoded;
+  castis::logger::detail::encode_args(encoded, 1, 2.5, "abc", true);
+  auto format = [&](int i) {
+    message.clear();
+    // formatted by the caller
+    strm << castis::logger::detail::formatted(
+        FMT_STRING("{}th line {:.2f} {} {}"), i, i * 0.5, "abc", true);
+    // formatted by the sink thread
+    auto& buffer = castis::logger::detail::thread_format_buffer();
+    char const* data = encoded.data();
+    castis::logger::detail::format_encoded(buffer, "{} {:.1f} {} {}", data,
+                                           data + encoded.size());
+    strm.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    strm.flush();
+  };
+  format(0);
+  EXPECT_EQ("0th line 0.00 abc true1 2.5 abc true", message);
+
+  auto before = allocations.load();
+  for (int i = 0; i < 1000; ++i) format(i);
+  EXPECT_EQ(before, allocations.load());
+  EXPECT_EQ("999th line 499.50 abc true1 2.5 abc true", message);
+}
+
+TEST(LoggerTest, cilog_lines_allocate_within_bound) {
+  std::filesystem::remove_all("./log_alloc");
+  auto count = [](std::string const& name, bool deferred) {
+    castis::logger::QueueOptions queue(1024);
+    queue.deferred_format_ = deferred;
+    auto sink = castis::logger::init_async_level_logger(
+        name, "1.0.0", {info}, name, "./log_alloc", 1024 * 1024 * 1024,
+        false, queue);
+    auto log = [&sink](int lines) {
+      for (int i = 0; i < lines; ++i) {
+        CILOG(info, "{}th line {:.2f} {} {}", i, i * 0.5, "abc", true);
+      }
+      sink->flush();
+    };
+    log(100);
+    auto before = allocations.load();
+    log(1000);
+    auto per_line = (allocations.load() - before) / 1000.0;
+    castis::logger::stop_logger(sink);
+    return per_line;
+  };
+  // counted on every thread, the statement, the core and the sink thread,
+  // with a few to spare for the sink's idle handler
+  EXPECT_GE(2.05, count("alloc", false));
+  EXPECT_GE(1.05, count("alloc_deferred", true));
+}
+
+TEST(LoggerTest, access_log_renders_combined_lines) {
+  std::filesystem::remove_all("./log_access");
+  auto sink = castis::logger::init_access_logger("access", "./log_access");
+  ACCESSLOG(castis::logger::AccessLog(
+      "142.43.55.13", "", "main", "[05/Sep/2018:16:48:09 +0900]",
+      "GET /foo HTTP/1.1", 200, 1024, "http://www.google.com/", "chrome/10.0",
+      100));
+  castis::logger::AccessLog empty("", "", "", "", "", 0, 0, "", "", 0);
+  ACCESSLOG(empty);
+  castis::logger::stop_logger(sink);
+  sink.reset();
+
+  std::ifstream file(
+      datetime_string_with_format("./log_access/%Y-%m/%Y-%m-%d_access.log"));
+  std::string line;
+  std::getline(file, line);
+  EXPECT_EQ(
+      "142.43.55.13 - main [05/Sep/2018:16:48:09 +0900] \"GET /foo HTTP/1.1\" "
+      "200 1024 \"http://www.google.com/\" \"chrome/10.0\"",
+      line);
+  std::ostringstream streamed;
+  streamed << empty;
+  std::getline(file, line);
+  EXPECT_EQ(streamed.str(), line);
+}
+
+TEST(LoggerTest, access_log_counts_dropped_records_without_a_notice) {
+  std::filesystem::remove_all("./log_access_drop");
+  castis::logger::QueueOptions queue(4);
+  queue.overflow_ = castis::logger::QueueOptions::drop_newest;
+  auto sink = castis::logger::init_access_logger(
+      "access", "./log_access_drop", 10 * 1024 * 1024, true, queue);
+  {
+    // the sink thread waits for the backend while the queue fills up
+    auto backend = sink->locked_backend();
+    for (int i = 0; i < 100; ++i) {
+      ACCESSLOG(castis::logger::AccessLog("142.43.55.13", "", "", "",
+                                          "GET /foo HTTP/1.1", 200, 1, "",
+                                          "", 100));
+    }
+  }
+  auto dropped = sink->dropped_records();
+  castis::logger::stop_logger(sink);
+  sink.reset();
+
+  std::ifstream file(datetime_string_with_format(
+      "./log_access_drop/%Y-%m/%Y-%m-%d_access.log"));
+  std::size_t written = 0;
+  for (std::string line; std::getline(file, line);) {
+    EXPECT_EQ(0, line.find("142.43.55.13 ")) << line;
+    ++written;
+  }
+  EXPECT_LT(0, dropped);
+  EXPECT_EQ(100, written + dropped);
+}
+
+TEST(LoggerTest, access_logger_keeps_attached_stats) {
+  std::filesystem::remove_all("./log_access_keep");
+  castis::logger::AccessStatsOptions options;
+  options.interval_ = std::chrono::seconds(0);
+  auto stats = std::make_shared<castis::logger::access_stats>(options);
+  castis::logger::set_access_stats(stats);
+  auto sink = castis::logger::init_access_logger("access", "./log_access_keep");
+  ACCESSLOG(castis::logger::AccessLog("142.43.55.13", "", "", "",
+                                      "GET /foo HTTP/1.1", 200, 1, "", "",
+                                      10));
+  castis::logger::set_access_stats(nullptr);
+  castis::logger::stop_logger(sink);
+  sink.reset();
+
+  auto summaries = stats->snapshot();
+  ASSERT_EQ(1, summaries.size());
+  EXPECT_EQ(1, summaries[0].count_);
+}
+
+TEST(LoggerTest, access_stats_summarize_serve_durations) {
+  std::filesystem::remove_all("./log_access_stats");
+  castis::logger::AccessStatsOptions options;
+  options.interval_ = std::chrono::seconds(0);
+  options.summary_path_ = "./log_access_stats/summary.log";
+  options.log_every_ = 2;
+  auto stats = std::make_shared<castis::logger::access_stats>(options);
+  auto sink = castis::logger::init_access_logger(
+      "access", "./log_access_stats", 10 * 1024 * 1024, true, {}, stats);
+  castis::logger::AccessRollupOptions rollup_options;
+  rollup_options.interval_ = std::chrono::hours(1);
+  auto rollup = castis::logger::init_access_rollup_logger(
+      "access_rollup", "./log_access_stats", 10 * 1024 * 1024, true, {},
+      rollup_options);
+  for (std::uint64_t us = 1; us <= 1000; ++us) {
+    ACCESSLOG(castis::logger::AccessLog(
+        "142.43.55.13", "", "", "", "GET /foo/a?x=1 HTTP/1.1", 200, 1, "",
+        "", us));
+  }
+  for (int i = 0; i < 10; ++i) {
+    ACCESSLOG(castis::logger::AccessLog("142.43.55.13", "", "", "",
+                                        "POST /bar HTTP/1.1", 500, 0, "", "",
+                                        5000));
+  }
+  castis::logger::set_access_stats(nullptr);
+  castis::logger::stop_logger(sink);
+  castis::logger::stop_logger(rollup);
+  sink.reset();
+  rollup.reset();
+
+  auto summaries = stats->snapshot();
+  ASSERT_EQ(2, summaries.size());
+  EXPECT_EQ("GET /foo 2xx", summaries[0].key_);
+  EXPECT_EQ(1000, summaries[0].count_);
+  EXPECT_NEAR(500, summaries[0].p50_, 15);
+  EXPECT_NEAR(990, summaries[0].p99_, 30);
+  EXPECT_NEAR(999, summaries[0].p999_, 30);
+  EXPECT_EQ(1000, summaries[0].max_);
+  EXPECT_EQ("POST /bar 5xx", summaries[1].key_);
+  EXPECT_EQ(10, summaries[1].count_);
+  EXPECT_NEAR(5000, summaries[1].p50_, 150);
+  EXPECT_EQ(5000, summaries[1].max_);
+
+  // detaching wrote the summary, there is nothing new since
+  stats->write_summary();
+  // the maximum of an interval is its own
+  stats->record(castis::logger::AccessLog("142.43.55.13", "", "", "",
+                                          "GET /foo HTTP/1.1", 200, 1, "",
+                                          "", 10));
+  stats->write_summary();
+  std::ifstream summary("./log_access_stats/summary.log");
+  std::vector<std::string> lines;
+  for (std::string line; std::getline(summary, line);) lines.push_back(line);
+  ASSERT_EQ(3, lines.size());
+  EXPECT_EQ(0, lines[0].find("access_stats GET /foo 2xx count=1000 p50="));
+  EXPECT_EQ(0, lines[1].find("access_stats POST /bar 5xx count=10 p50="));
+  EXPECT_EQ("access_stats GET /foo 2xx count=1 p50=10us p99=10us "
+            "p999=10us max=10us",
+            lines[2]);
+
+  // every second statement is written
+  std::ifstream file(datetime_string_with_format(
+      "./log_access_stats/%Y-%m/%Y-%m-%d_access.log"));
+  std::size_t written = 0;
+  for (std::string line; std::getline(file, line);) ++written;
+  EXPECT_EQ(505, written);
+
+  // the rollup counts the statements that are not written as well
+  std::ifstream rollup_file(datetime_string_with_format(
+      "./log_access_stats/%Y-%m/%Y-%m-%d_access_rollup.log"));
+  std::vector<std::string> counters;
+  for (std::string line; std::getline(rollup_file, line);) {
+    ASSERT_LT(20, line.size());
+    counters.push_back(line.substr(20));
+  }
+  std::vector<std::string> expected = {
+      "GET /foo 2xx requests=1000 bytes=1000",
+      "POST /bar 5xx requests=10 bytes=0",
+  };
+  EXPECT_EQ(expected, counters);
+}
+
+TEST(LoggerTest, access_stats_cap_keys_and_keep_exited_threads) {
+  castis::logger::AccessStatsOptions options;
+  options.interval_ = std::chrono::seconds(0);
+  options.max_keys_ = 2;
+  castis::logger::access_stats stats(options);
+  auto record = [&stats](std::string const& request_line) {
+    stats.record(castis::logger::AccessLog("142.43.55.13", "", "", "",
+                                           request_line, 200, 1, "", "",
+                                           100));
+  };
+  for (int i = 0; i < 3; ++i) {
+    std::thread([&] {
+      record("GET /a HTTP/1.1");
+      record("GET /b HTTP/1.1");
+      record("GET /random" + std::to_string(i) + " HTTP/1.1");
+    }).join();
+    // the histograms of the exited thread are merged into the others
+    auto summaries = stats.snapshot();
+    ASSERT_EQ(3, summaries.size());
+    EXPECT_EQ("GET /a 2xx", summaries[0].key_);
+    EXPECT_EQ(i + 1, summaries[0].count_);
+    EXPECT_EQ("GET /b 2xx", summaries[1].key_);
+    EXPECT_EQ(i + 1, summaries[1].count_);
+    EXPECT_EQ("other", summaries[2].key_);
+    EXPECT_EQ(i + 1, summaries[2].count_);
+  }
+}
+
+TEST(LoggerTest, access_rollup_counts_requests_by_key) {
+  std::filesystem::remove_all("./log_rollup");
+  castis::logger::AccessRollupOptions options;
+  options.interval_ = std::chrono::hours(1);
+  auto rollup = castis::logger::init_access_rollup_logger(
+      "access_rollup", "./log_rollup", 10 * 1024 * 1024, true, {}, options);
+  auto sink = castis::logger::init_access_logger("access", "./log_rollup");
+  auto access = [](std::string_view request_line, unsigned status,
+                   std::size_t bytes) {
+    ACCESSLOG(castis::logger::AccessLog("142.43.55.13", "", "", "",
+                                        request_line, status, bytes, "", "",
+                                        100));
+  };
+  access("GET /foo/a HTTP/1.1", 200, 100);
+  access("POST /bar HTTP/1.1", 201, 10);
+  access("GET /foo/b?x=1 HTTP/1.1", 206, 100);
+  access("GET /foo/c HTTP/1.1", 404, 0);
+  access("GET /foo HTTP/1.1", 200, 100);
+  access("POST /bar/d HTTP/1.1", 200, 10);
+  castis::logger::stop_logger(sink);
+  castis::logger::stop_logger(rollup);
+  sink.reset();
+  rollup.reset();
+
+  std::ifstream file(datetime_string_with_format(
+      "./log_rollup/%Y-%m/%Y-%m-%d_access_rollup.log"));
+  std::vector<std::string> lines;
+  for (std::string line; std::getline(file, line);) {
+    // "2018-09-05 16:00:00 " is the start of the interval
+    ASSERT_LT(20, line.size());
+    EXPECT_EQ(":00 ", line.substr(16, 4));
+    lines.push_back(line.substr(20));
+  }
+  std::vector<std::string> expected = {
+      "GET /foo 2xx requests=3 bytes=300",
+      "GET /foo 4xx requests=1 bytes=0",
+      "POST /bar 2xx requests=2 bytes=20",
+  };
+  EXPECT_EQ(expected, lines);
+
+  std::ifstream access_file(datetime_string_with_format(
+      "./log_rollup/%Y-%m/%Y-%m-%d_access.log"));
+  std::size_t written = 0;
+  for (std::string line; std::getline(access_file, line);) ++written;
+  EXPECT_EQ(6, written);
+}
+
+TEST(LoggerTest, access_rollup_buckets_by_record_timestamp) {
+  std::filesystem::remove_all("./log_rollup_time");
+  castis::logger::AccessRollupOptions options;
+  options.interval_ = std::chrono::hours(1);
+  auto rollup = castis::logger::init_access_rollup_logger(
+      "access_rollup", "./log_rollup_time", 10 * 1024 * 1024, true, {},
+      options);
+  auto access = [](std::string_view request_line) {
+    ACCESSLOG(castis::logger::AccessLog("142.43.55.13", "", "", "",
+                                        request_line, 200, 100, "", "", 100));
+  };
+  access("GET /now HTTP/1.1");
+  // queued as the hour ends, the sink thread takes it in the next hour
+  auto next = boost::posix_time::second_clock::local_time() +
+              boost::posix_time::hours(1);
+  {
+    // the thread attribute hides the global "TimeStamp" clock
+    auto tag = boost::log::core::get()->add_thread_attribute(
+        "TimeStamp",
+        boost::log::attributes::constant<boost::posix_time::ptime>(next));
+    access("GET /next HTTP/1.1");
+    boost::log::core::get()->remove_thread_attribute(tag.first);
+  }
+  castis::logger::stop_logger(rollup);
+  rollup.reset();
+
+  std::ifstream file(datetime_string_with_format(
+      "./log_rollup_time/%Y-%m/%Y-%m-%d_access_rollup.log"));
+  std::vector<std::string> lines;
+  for (std::string line; std::getline(file, line);) lines.push_back(line);
+  ASSERT_EQ(2, lines.size());
+  EXPECT_EQ(datetime_string_with_format("%Y-%m-%d %H:00:00") +
+                " GET /now 2xx requests=1 bytes=100",
+            lines[0]);
+  auto next_hour = fmt::format("{} {:02}:00:00",
+                               boost::gregorian::to_iso_extended_string(
+                                   next.date()),
+                               next.time_of_day().hours());
+  EXPECT_EQ(next_hour + " GET /next 2xx requests=1 bytes=100", lines[1]);
+}
+
+TEST(LoggerTest, flush_policy_flushes_idle_sink_by_timer) {
+  std::filesystem::remove_all("./log_flush");
+  auto sink = castis::logger::init_async_level_logger(
+      "flush", "1.0.0", {error}, "flush", "./log_flush", 10 * 1024 * 1024,
+      castis::logger::FlushPolicy(std::chrono::milliseconds(50), 1024 * 1024));
+  CILOG(error) << "flushed by timer";
+
+  std::string filepath =
+      datetime_string_with_format("./log_flush/%Y-%m/%Y-%m-%d_flush.log");
+  std::string line;
+  for (int i = 0; i < 100 && line.empty(); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::ifstream file(filepath);
+    std::getline(file, line);
+  }
+  EXPECT_NE(std::string::npos, line.find("flushed by timer"));
+  castis::logger::stop_logger(sink);
+}
+
+TEST(LoggerTest, flush_policy_severity_flushes_under_load) {
+  std::filesystem::remove_all("./log_flush_load");
+  auto sink = castis::logger::init_async_level_logger(
+      "flush_load", "1.0.0", {info, error}, "flush_load", "./log_flush_load",
+      10 * 1024 * 1024,
+      castis::logger::FlushPolicy(std::chrono::milliseconds(0), 1024 * 1024,
+                                  error));
+  // a queue that never runs dry never gets to the idle flush
+  sink->set_idle_handler(std::chrono::milliseconds(0), [] {});
+  std::atomic<bool> stop{false};
+  // slow enough that the lines never fill a batch and get written with it
+  std::thread load([&stop] {
+    while (!stop.load()) {
+      CILOG(info) << "load";
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  });
+  CILOG(error) << "flushed by severity";
+
+  std::string filepath = datetime_string_with_format(
+      "./log_flush_load/%Y-%m/%Y-%m-%d_flush_load.log");
+  bool flushed = false;
+  for (int i = 0; i < 100 && !flushed; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::ifstream file(filepath);
+    for (std::string line; !flushed && std::getline(file, line);) {
+      flushed = line.find("flushed by severity") != std::string::npos;
+    }
+  }
+  stop = true;
+  load.join();
+  EXPECT_TRUE(flushed);
+  castis::logger::stop_logger(sink);
+}
+
+TEST(LoggerTest, batched_writes_rotate_at_line_boundaries) {
+  std::filesystem::remove_all("./log_batch");
+  namespace expr = boost::log::expressions;
+  auto sink = castis::logger::init_async_logger(
+      "batch", "1.0.0", "./log_batch", 1000, true);
+  sink->set_formatter(expr::stream << expr::smessage);
+  for (int i = 0; i < 100; ++i) {
+    CILOG(info) << fmt::format("{:03}", i) << std::string(46, '-');
+  }
+  castis::logger::stop_logger(sink);
+  sink.reset();
+
+  // 50 bytes per line: every file but the last ends on the line that
+  // crossed 1000 bytes
+  std::vector<std::string> files;
+  for (auto& entry : std::filesystem::recursive_directory_iterator(
+           "./log_batch")) {
+    if (!entry.is_symlink() && entry.is_regular_file()) {
+      files.push_back(entry.path().string());
+    }
+  }
+  ASSERT_EQ(5u, files.size());
+  std::size_t lines = 0;
+  for (auto const& path : files) {
+    EXPECT_EQ(1000u, std::filesystem::file_size(path)) << path;
+    std::ifstream file(path);
+    for (std::string line; std::getline(file, line); ++lines) {
+      EXPECT_EQ(49u, line.size());
+    }
+  }
+  EXPECT_EQ(100u, lines);
+}
+
+TEST(LoggerTest, mmap_backend_truncates_preallocated_files) {
+  std::filesystem::remove_all("./log_mmap");
+  namespace expr = boost::log::expressions;
+  auto sink = castis::logger::init_async_mmap_logger(
+      "mmap", "1.0.0", "./log_mmap", 1000, true);
+  sink->set_formatter(expr::stream << expr::smessage);
+  for (int i = 0; i < 50; ++i) CILOG(info) << std::string(49, '-');
+  castis::logger::stop_logger(sink);
+  // the last file is truncated when the backend goes away
+  sink.reset();
+
+  auto today = datetime_string_with_format("%Y-%m-%d");
+  auto month = datetime_string_with_format("./log_mmap/%Y-%m/");
+  EXPECT_EQ(1000u, std::filesystem::file_size(month + today + "_mmap.log"));
+  EXPECT_EQ(1000u,
+            std::filesystem::file_size(month + today + "[1]_mmap.log"));
+  EXPECT_EQ(500u, std::filesystem::file_size(month + today + "[2]_mmap.log"));
+  EXPECT_EQ(500u, std::filesystem::file_size("./log_mmap/mmap.log"));
+
+  // a file left preallocated by a crash is continued after its last line
+  {
+    std::ofstream crashed("./log_mmap/crashed.log");
+    crashed << "line\n" << std::string(100, '\0');
+  }
+  castis::logger::detail::mapped_file file;
+  ASSERT_TRUE(file.open("./log_mmap/crashed.log", 1000));
+  EXPECT_EQ(5u, file.opened_size());
+  file.append("next");
+  file.close();
+  std::ifstream crashed("./log_mmap/crashed.log");
+  std::string content((std::istreambuf_iterator<char>(crashed)),
+                      std::istreambuf_iterator<char>());
+  EXPECT_EQ("line\nnext\n", content);
+}
+
+TEST(LoggerTest, uring_backend_writes_rotated_files) {
+  std::filesystem::remove_all("./log_uring");
+  namespace expr = boost::log::expressions;
+  castis::logger::FlushPolicy flush_policy(std::chrono::milliseconds(10),
+                                           64 * 1024);
+  auto sink = castis::logger::init_async_uring_logger(
+      "uring", "1.0.0", "./log_uring", 1000, flush_policy);
+  sink->set_formatter(expr::stream << expr::smessage);
+  for (int i = 0; i < 50; ++i) CILOG(info) << std::string(49, '-');
+  castis::logger::stop_logger(sink);
+  sink.reset();
+
+  // the same files whether io_uring is available or not
+  auto today = datetime_string_with_format("%Y-%m-%d");
+  auto month = datetime_string_with_format("./log_uring/%Y-%m/");
+  EXPECT_EQ(1000u, std::filesystem::file_size(month + today + "_uring.log"));
+  EXPECT_EQ(1000u,
+            std::filesystem::file_size(month + today + "[1]_uring.log"));
+  EXPECT_EQ(500u, std::filesystem::file_size(month + today + "[2]_uring.log"));
+
+  // lines longer than a buffer are split across buffers in order
+  castis::logger::detail::uring_file file;
+  ASSERT_TRUE(file.open("./log_uring/long.log"));
+  std::string line(castis::logger::detail::uring_file::kBatchSize * 3 / 2, 'x');
+  for (int i = 0; i < 8; ++i) file.append(line);
+  file.write_pending();
+  file.close();
+  EXPECT_TRUE(file.good());
+  EXPECT_EQ(8 * (line.size() + 1),
+            std::filesystem::file_size("./log_uring/long.log"));
+
+  // flushes that fdatasync keep the writes whole
+  castis::logger::detail::uring_file synced;
+  synced.set_sync(true);
+  ASSERT_TRUE(synced.open("./log_uring/synced.log"));
+  for (int i = 0; i < 100; ++i) {
+    synced.append(std::string(99, 's'));
+    synced.write_pending();
+  }
+  synced.close();
+  EXPECT_TRUE(synced.good());
+  EXPECT_EQ(10000u, std::filesystem::file_size("./log_uring/synced.log"));
+}
+
+TEST(LoggerTest, binary_log_decodes_to_text_lines) {
+  std::filesystem::remove_all("./log_bin");
+  static const castis::logger::CallSite site("loggertest.cpp", "binary", 1,
+                                             "", "default");
+  static const castis::logger::FormatSite format_site(site,
+                                                      "{} {:.2f} {} {}");
+  // no binary logger runs, the statement goes to the sinks
+  EXPECT_FALSE(castis::logger::detail::binary_log(format_site, info, 1, 1.0,
+                                                  "text", true));
+
+  auto logger = castis::logger::init_binary_logger("bin", "1.0.0",
+                                                   "./log_bin");
+  std::thread other([] {
+    castis::logger::detail::binary_log(format_site, warning, -7, 0.5,
+                                       std::string("other"), 'c');
+  });
+  other.join();
+  EXPECT_TRUE(castis::logger::detail::binary_log(format_site, info, 42,
+                                                 3.14159, "abc", false));
+  // the module loggers take the statements of other channels
+  static const castis::logger::CallSite module_site("loggertest.cpp",
+                                                    "binary", 1, "", "mod");
+  static const castis::logger::FormatSite module_format_site(module_site,
+                                                             "{}");
+  EXPECT_FALSE(
+      castis::logger::detail::binary_log(module_format_site, info, 1));
+  // a type the codec does not know is formatted with its spec by the caller
+  static const castis::logger::FormatSite chrono_site(site, "{:%H:%M} {:x}");
+  EXPECT_TRUE(castis::logger::detail::binary_log(
+      chrono_site, info, std::chrono::minutes(90), 255));
+  castis::logger::stop_logger(logger);
+
+  std::ifstream in("./log_bin/bin.clog", std::ios::binary);
+  std::ostringstream out;
+  ASSERT_TRUE(castis::logger::decode_binary_log(in, out));
+  std::istringstream lines(out.str());
+  std::string first, second, third;
+  std::getline(lines, first);
+  std::getline(lines, second);
+  std::getline(lines, third);
+  EXPECT_EQ(0u, first.find("bin,1.0.0,"));
+  EXPECT_NE(std::string::npos,
+            first.find(",Warning,loggertest.cpp::binary:1:"));
+  EXPECT_EQ(",,-7 0.50 other c",
+            first.substr(first.size() - std::strlen(",,-7 0.50 other c")));
+  EXPECT_NE(std::string::npos, second.find(",Information,"));
+  EXPECT_EQ(",,42 3.14 abc false",
+            second.substr(second.size() - std::strlen(",,42 3.14 abc false")));
+  EXPECT_NE(std::string::npos,
+            third.find(",Information,loggertest.cpp::binary:1:"));
+  EXPECT_EQ(",,01:30 ff",
+            third.substr(third.size() - std::strlen(",,01:30 ff")));
+}
+
+TEST(LoggerTest, binary_log_keeps_entries_appended_during_stop) {
+  std::filesystem::remove_all("./log_bin_stop");
+  static const castis::logger::CallSite site("loggertest.cpp", "binary", 2,
+                                             "", "default");
+  static const castis::logger::FormatSite format_site(site, "{}");
+  auto logger = castis::logger::init_binary_logger("bin_stop", "1.0.0",
+                                                   "./log_bin_stop");
+  std::atomic<int> accepted{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&accepted] {
+      for (int i = 0; i < 20000; ++i) {
+        if (!castis::logger::detail::binary_log(format_site, info, i)) break;
+        ++accepted;
+      }
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  castis::logger::stop_logger(logger);
+  for (auto& t : threads) t.join();
+
+  // every entry binary_log took is in the file
+  std::ifstream in("./log_bin_stop/bin_stop.clog", std::ios::binary);
+  std::ostringstream out;
+  ASSERT_TRUE(castis::logger::decode_binary_log(in, out));
+  std::istringstream lines(out.str());
+  int decoded = 0;
+  for (std::string line; std::getline(lines, line);) ++decoded;
+  EXPECT_EQ(accepted.load(), decoded);
+}
+
+TEST(LoggerTest, rotation_state_file_keeps_index_across_restarts) {
+  std::filesystem::remove_all("./log_state");
+  namespace expr = boost::log::expressions;
+  castis::logger::RotationPolicy rotation(1000);
+  rotation.state_file_ = true;
+  auto write_lines = [&](int count) {
+    auto sink = castis::logger::init_async_logger(
+        "state", "1.0.0", "./log_state", rotation, true);
+    sink->set_formatter(expr::stream << expr::smessage);
+    for (int i = 0; i < count; ++i) CILOG(info) << std::string(49, '-');
+    castis::logger::stop_logger(sink);
+  };
+  write_lines(30);
+
+  auto today = datetime_string_with_format("%Y-%m-%d");
+  std::ifstream state("./log_state/.state.index");
+  std::string prefix;
+  int index = -1;
+  state >> prefix >> index;
+  EXPECT_EQ(today, prefix);
+  EXPECT_EQ(1, index);
+
+  // the restart appends to [1] until it is full
+  write_lines(10);
+  auto month = datetime_string_with_format("./log_state/%Y-%m/");
+  EXPECT_EQ(1000u, std::filesystem::file_size(month + today + "_state.log"));
+  EXPECT_EQ(1000u,
+            std::filesystem::file_size(month + today + "[1]_state.log"));
+  EXPECT_FALSE(std::filesystem::exists(month + today + "[2]_state.log"));
+}
+
+TEST(LoggerTest, rotated_files_are_compressed_in_background) {
+  std::filesystem::remove_all("./log_gz");
+  namespace expr = boost::log::expressions;
+  auto compressor = std::make_shared<castis::logger::log_compressor>();
+  auto sink = castis::logger::init_async_logger(
+      "gz", "1.0.0", "./log_gz", 1000, true);
+  castis::logger::compress_rotated_files(sink, compressor);
+  sink->set_formatter(expr::stream << expr::smessage);
+  for (int i = 0; i < 50; ++i) CILOG(info) << std::string(49, '-');
+  castis::logger::stop_logger(sink);
+  compressor->wait_idle();
+
+  auto today = datetime_string_with_format("%Y-%m-%d");
+  auto month = datetime_string_with_format("./log_gz/%Y-%m/");
+  for (auto name : {today + "_gz.log", today + "[1]_gz.log"}) {
+    EXPECT_FALSE(std::filesystem::exists(month + name));
+    gzFile gz = gzopen((month + name + ".gz").c_str(), "rb");
+    ASSERT_NE(nullptr, gz);
+    char buf[2048];
+    EXPECT_EQ(1000, gzread(gz, buf, sizeof(buf)));
+    gzclose(gz);
+  }
+  // the active file is left alone
+  EXPECT_EQ(500u, std::filesystem::file_size(month + today + "[2]_gz.log"));
+  EXPECT_TRUE(std::filesystem::exists("./log_gz/gz.log"));
+}
+
+TEST(LoggerTest, retention_removes_oldest_rotated_files) {
+  std::filesystem::remove_all("./log_ret");
+  namespace expr = boost::log::expressions;
+  castis::logger::RetentionPolicy policy(3500);
+  policy.max_files_ = 2;
+  auto manager =
+      std::make_shared<castis::logger::retention_manager>("./log_ret", policy);
+  auto sink = castis::logger::init_async_logger(
+      "ret", "1.0.0", "./log_ret", 1000, true);
+  castis::logger::retain_rotated_files(sink, manager);
+  sink->set_formatter(expr::stream << expr::smessage);
+  for (int i = 0; i < 110; ++i) CILOG(info) << std::string(49, '-');
+  castis::logger::stop_logger(sink);
+  manager->wait_idle();
+
+  // [0] to [4] were rotated out, the size limit keeps [2] to [4] and the
+  // file limit only [3] and [4]
+  auto today = datetime_string_with_format("%Y-%m-%d");
+  auto month = datetime_string_with_format("./log_ret/%Y-%m/");
+  EXPECT_FALSE(std::filesystem::exists(month + today + "_ret.log"));
+  for (int index : {1, 2}) {
+    EXPECT_FALSE(std::filesystem::exists(
+        month + today + "[" + std::to_string(index) + "]_ret.log"));
+  }
+  for (int index : {3, 4}) {
+    EXPECT_TRUE(std::filesystem::exists(
+        month + today + "[" + std::to_string(index) + "]_ret.log"));
+  }
+  EXPECT_EQ(500u, std::filesystem::file_size(month + today + "[5]_ret.log"));
+  EXPECT_EQ(2000u, manager->total_bytes());
+
+  // a restarted manager finds the same files and leaves the newest alone
+  castis::logger::retention_manager restarted("./log_ret", policy);
+  restarted.wait_idle();
+  EXPECT_EQ(2000u, restarted.total_bytes());
+}
+
+TEST(LoggerTest, rotation_schedule_aligns_to_local_interval) {
+  for (int minutes : {10, 15, 30, 60, 24 * 60}) {
+    castis::logger::detail::rotation_schedule schedule(
+        (std::chrono::minutes(minutes)));
+    auto now = std::time(nullptr);
+    schedule.start();
+    auto start = schedule.interval_start();
+    tm local;
+    localtime_r(&start, &local);
+    EXPECT_LE(start, now);
+    EXPECT_GT(start + minutes * 60, now);
+    EXPECT_EQ(0, local.tm_sec);
+    EXPECT_EQ(0, (local.tm_hour * 60 + local.tm_min) % minutes);
+    EXPECT_FALSE(schedule.due(std::chrono::steady_clock::now()));
+
+    // a second after the boundary, then the clock steps back
+    schedule.start(start + 1);
+    EXPECT_EQ(start, schedule.interval_start());
+    EXPECT_FALSE(schedule.check_wall_clock(start - 1));
+    EXPECT_TRUE(schedule.check_wall_clock(start - 3600));
+    EXPECT_TRUE(schedule.check_wall_clock(start + minutes * 60 + 3600));
+  }
+}
+
+TEST(LoggerTest, module_filter_table_matches_module_scan) {
+  using castis::logger::Module;
+  std::vector<Module> modules = {
+      Module("module1", std::set<severity_level>{debug, error}),
+      Module(warning),
+      Module("module2", info),
+      Module("access", foo),
+      Module("module1", critical)};
+  castis::logger::module_filter_table table(modules);
+  for (std::string channel : {"module1", "module2", "access", "default",
+                              "other", "access.unsampled", "cilog_stats"}) {
+    auto id = castis::logger::intern_channel(channel);
+    for (int i = foo; i <= critical; ++i) {
+      auto level = static_cast<severity_level>(i);
+      EXPECT_EQ(castis::logger::func_module_severity_filter(
+                    boost::log::value_ref<castis::logger::channel_id>(id),
+                    boost::log::value_ref<severity_level>(level), modules),
+                table.accepts(id, level))
+          << channel << " " << i;
+    }
+  }
+  // the unnamed module does not take the stats_reporter records
+  EXPECT_FALSE(table.accepts(castis::logger::kStatsChannel, error));
+  EXPECT_TRUE(table.accepts(castis::logger::intern_channel("other"), error));
+}
+
+TEST(LoggerTest, channel_names_are_looked_up_by_id) {
+  // enough names to fill more than the first chunks of the table
+  for (int i = 0; i < 300; ++i) {
+    auto name = "channel" + std::to_string(i);
+    auto id = castis::logger::intern_channel(name);
+    EXPECT_EQ(id, castis::logger::intern_channel(name));
+    EXPECT_EQ(name, castis::logger::channel_name(id));
+  }
+  EXPECT_EQ("access",
+            castis::logger::channel_name(castis::logger::kAccessChannel));
+  EXPECT_EQ("", castis::logger::channel_name(1u << 31));
+}
+
+TEST(LoggerTest, format_timestamp_matches_date_time_facet) {
+  namespace pt = boost::posix_time;
+  auto base = pt::ptime(boost::gregorian::date(2014, 8, 13),
+                        pt::hours(23) + pt::minutes(59) + pt::seconds(58));
+  for (long us : {0L, 7L, 999999L, 1000000L, 1000001L, 1999999L, 2000123L}) {
+    auto timestamp = base + pt::microseconds(us);
+
+    std::stringstream expected;
+    expected.imbue(std::locale(std::locale::classic(),
+                               new pt::time_facet("%Y-%m-%d,%H:%M:%S.%f")));
+    expected << timestamp;
+
+    std::string actual;
+    boost::log::formatting_ostream strm(actual);
+    castis::logger::detail::format_timestamp(timestamp, strm);
+    strm.flush();
+    EXPECT_EQ(expected.str(), actual);
+  }
+}
+
+// init_logger's sink is never removed and formats on the calling thread,
+// which turns deferred formatting off for every test after it
 TEST(LoggerTest, dummy) {
   castis::logger::init_logger("example", "1.0.0");
   // add a log line